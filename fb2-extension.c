@@ -1,26 +1,39 @@
 #include <assert.h>
 #include <errno.h>
 
-#include <libxml/tree.h>
 #include <libxml/parser.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
 
-#include <zip.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h> /* For numeric (size_t) limits. */
 #include <string.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <nautilus-extension.h>
 
+#include "fb2-index.h"
+#include "fb2-parse.h"
+
 typedef struct _FB2Extension FB2Extension;
 typedef struct _FB2ExtensionClass FB2ExtensionClass;
 
+/* Identity of a file on disk, for the negative cache */
+typedef struct {
+    guint64 device;
+    guint64 inode;
+    gint64 size;
+    gint64 mtime;
+} FB2FileKey;
+
 typedef struct {
     GClosure *update_complete;
     NautilusInfoProvider *provider;
     NautilusFileInfo *file;
+    char *filename;
+    FB2FileKey key;
+    gboolean fb2_named; /* By name or MIME type, not only a generic candidate */
     int operation_handle;
     gboolean cancelled;
 } UpdateHandle;
@@ -43,42 +56,71 @@ static NautilusOperationResult fb2_extension_update_file_info (
                                 NautilusFileInfo *file,
                                 GClosure *update_complete,
                                 NautilusOperationHandle **handle);
-/* Start FB2 only */                 
-#define LEN_SEQUENCE_STR 100
-typedef struct
-{
-    xmlChar *title;
-    xmlChar *first_name;
-    xmlChar *last_name;
-    xmlChar *middle_name;
-    xmlChar sequence[LEN_SEQUENCE_STR];
-} FB2Info;
-        
-static int read_from_plain_fb2(const char* filename, FB2Info *info);
-static int read_from_zip_fb2(const char *archive, FB2Info *info);
-static int parse_xml_from_buffer(char *content, zip_uint64_t uncomp_size, FB2Info *info);
-static int process_xml(xmlDocPtr doc, FB2Info *info);
-static void clear_FB2Info(FB2Info *info);
-
-enum FB2_RESULT {
-    FB2_RESULT_OK = 0,
-    FB2_RESULT_INVALID_FB2,
-    FB2_RESULT_CANT_OPEN,
-    FB2_RESULT_ZIP_OPEN_FILE_ERR,
-    FB2_RESULT_ZIP_READ_FILE_ERR,
-    FB2_RESULT_ZIP_CANT_CLOSE,
-    FB2_RESULT_UNABLE_PARSE_MEM_BUFF,
-    FB2_RESULT_UNABLE_CREATE_XPATH_CONTEXT
-};
+gint timeout_fb2_callback(gpointer data);
+
+static void fb2_set_file_error(NautilusFileInfo *file, const char *message);
+
+/* Cooperative (time-sliced) parsing */
+#define FB2_MAX_ACTIVE_JOBS 4
+/* Per idle tick, microseconds. FB2_EXTENSION_IDLE_BUDGET_MS overrides it,
+   0 parses every book in one go from its own idle callback. */
+#define FB2_DEFAULT_IDLE_BUDGET 4000
+
+typedef struct {
+    UpdateHandle *handle;
+    FB2Parser *parser;
+} FB2Job;
+
+static GQueue fb2_pending_jobs = G_QUEUE_INIT;
+static GQueue fb2_active_jobs = G_QUEUE_INIT;
+static guint fb2_jobs_source = 0;
+static gint64 fb2_idle_budget = FB2_DEFAULT_IDLE_BUDGET;
+
+static void fb2_queue_job(UpdateHandle *handle);
+static void fb2_drop_jobs(void);
+
+/* Search index, see fb2-index.h. Written from a thread of its own. */
+#define FB2_INDEX_MAX_BATCH 1000
+
+typedef enum {
+    FB2_INDEX_OP_PUT = 0,
+    FB2_INDEX_OP_REMOVE,
+    FB2_INDEX_OP_REJECT,
+    FB2_INDEX_OP_UNREJECT,
+    FB2_INDEX_OP_QUIT
+} FB2IndexOpType;
+
+/* Queued write, all strings are owned by the op */
+typedef struct {
+    FB2IndexOpType type;
+    FB2IndexBook book;
+    FB2IndexReject reject;
+} FB2IndexOp;
 
-const static char nonFb2[] = "Non FB2 file.";
-const static char *fb2_errors[] = {"ok", "Invalid FB2 file.", "can't open zip archive",
-                                    "ZIP read error", "ZIP inner file read error",
-                                    "can't close zip archive", "Error: unable to parse file from memory buffer",
-                                    "Error: unable to create new XPath context"};
+static GThread *fb2_index_thread = NULL;
+static GAsyncQueue *fb2_index_queue = NULL;
+static gboolean fb2_index_disabled = FALSE;
 
-gint timeout_plain_fb2_callback(gpointer data);
-gint timeout_zip_fb2_callback(gpointer data);
+static void fb2_index_book(const char *filename, const FB2FileKey *key, FB2Info *info);
+static void fb2_index_remove_book(const char *filename);
+static void fb2_index_shutdown(void);
+
+/* Negative cache, an LRU in memory and everything in the index database */
+#define FB2_MAX_REJECTS 100000
+
+typedef struct {
+    FB2FileKey key;
+    const char *reason; /* Interned */
+    GList link;         /* In fb2_rejects_lru */
+} FB2Reject;
+
+static GHashTable *fb2_rejects = NULL;
+static GQueue fb2_rejects_lru = G_QUEUE_INIT;
+static GMutex fb2_rejects_lock;
+
+static char *fb2_rejected(const FB2FileKey *key);
+static void fb2_reject(const FB2FileKey *key, const char *filename,
+                       const char *reason);
 /*end */
 
 /* Interfaces */
@@ -189,6 +231,44 @@ static GList *fb2_extension_get_columns(NautilusColumnProvider *provider)
 }
 
 /* Info interfaces */
+static const char *fb2_mime_types[] = {
+    "application/x-fictionbook+xml",
+    "application/x-zip-compressed-fb2"
+};
+
+/* Books that don't say so by name have one of these */
+static const char *fb2_container_mime_types[] = {
+    "application/xml",
+    "text/xml",
+    "application/zip",
+    "application/gzip",
+    "application/x-gzip",
+    "application/x-bzip",
+    "application/x-bzip2",
+    "application/x-xz",
+    "application/octet-stream"
+};
+
+static gboolean
+fb2_is_named(const char *mime_type, const char *name)
+{
+    if(fb2_is_book_name(name))
+        return TRUE;
+    for(int i = 0; i < G_N_ELEMENTS(fb2_mime_types); ++i)
+        if(g_strcmp0(mime_type, fb2_mime_types[i]) == 0)
+            return TRUE;
+    return FALSE;
+}
+
+static gboolean
+fb2_is_container(const char *mime_type)
+{
+    for(int i = 0; i < G_N_ELEMENTS(fb2_container_mime_types); ++i)
+        if(g_strcmp0(mime_type, fb2_container_mime_types[i]) == 0)
+            return TRUE;
+    return FALSE;
+}
+
 static NautilusOperationResult
 fb2_extension_update_file_info (NautilusInfoProvider *provider,
                 NautilusFileInfo *file,
@@ -198,18 +278,17 @@ fb2_extension_update_file_info (NautilusInfoProvider *provider,
     if(nautilus_file_info_is_directory(file))
         return NAUTILUS_OPERATION_COMPLETE;
     char *mime_type = nautilus_file_info_get_mime_type(file);
-    if( !(g_strcmp0(mime_type, "application/x-fictionbook+xml") == 0 ||
-    g_strcmp0(mime_type, "application/x-zip-compressed-fb2") == 0 ) )
-    {
-        #ifdef DEBUG
-        char *filename = nautilus_file_info_get_name(file);
-        fprintf(stderr, "Filename %s MIME: %s\n", filename, mime_type);
-        g_free(filename);
-        #endif
-        g_free(mime_type);
-        return NAUTILUS_OPERATION_COMPLETE;
-    }
+    char *name = nautilus_file_info_get_name(file);
+    const gboolean fb2_named = fb2_is_named(mime_type, name);
+    const gboolean candidate = fb2_named || fb2_is_container(mime_type);
+    #ifdef DEBUG
+    if(!candidate)
+        fprintf(stderr, "Filename %s MIME: %s\n", name, mime_type);
+    #endif
+    g_free(name);
     g_free(mime_type);
+    if(!candidate)
+        return NAUTILUS_OPERATION_COMPLETE;
     char *data = NULL;
     char *dataTitle = NULL;
     char *dataFirstName = NULL;
@@ -226,48 +305,46 @@ fb2_extension_update_file_info (NautilusInfoProvider *provider,
        If the operation is not fast enough, we should use the arguments 
        update_complete and handle for asyncrhnous operation. */
     if (!data) {
-        char *filename = nautilus_file_info_get_name(file);
-        const size_t len = strlen(filename);
-        if(len > 4 && g_strcmp0(&filename[len-4], ".fb2") == 0) {
-            /* Plain FB2 */
-            UpdateHandle *update_handle = g_new0 (UpdateHandle, 1);
-            update_handle->update_complete = g_closure_ref(update_complete);
-            update_handle->provider = provider;
-            update_handle->file = g_object_ref (file);
-            //g_timeout_add (1, 
-            g_idle_add(
-                timeout_plain_fb2_callback, 
-                update_handle);
-            *handle = update_handle;
+        GFile *location = nautilus_file_info_get_location(file);
+        char *filename = g_file_get_path(location);
+        g_object_unref(location);
+        GStatBuf st;
+        if(filename == NULL || g_stat(filename, &st) != 0) {
+            /* Not a local file */
             g_free(filename);
-            return NAUTILUS_OPERATION_IN_PROGRESS;      
-        } else {
-            if(len > 8 && g_strcmp0(&filename[len-8], ".fb2.zip") == 0) {
-                /*Zipped FB2*/
-                UpdateHandle *update_handle = g_new0 (UpdateHandle, 1);
-                update_handle->update_complete = g_closure_ref(update_complete);
-                update_handle->provider = provider;
-                update_handle->file = g_object_ref (file);
-                //g_timeout_add (1, 
-                g_idle_add(
-                        timeout_zip_fb2_callback, 
-                        update_handle);
-                *handle = update_handle;
-                
-                g_free(filename);
-                return NAUTILUS_OPERATION_IN_PROGRESS;
-            } else {
-                /* Other filetype */
-                nautilus_file_info_add_string_attribute(file,
-                                                        "FB2Extension::fb2_data",
-                                                        nonFb2);
-                nautilus_file_info_add_string_attribute(file,
-                                                        "FB2Extension::fb2_title",
-                                                        nonFb2);
-            }
+            return NAUTILUS_OPERATION_COMPLETE;
         }
-        g_free(filename);
-        return NAUTILUS_OPERATION_COMPLETE;
+        FB2FileKey key;
+        key.device = (guint64)st.st_dev;
+        key.inode = (guint64)st.st_ino;
+        key.size = st.st_size;
+        /* Several writes within a second must not look unchanged */
+        key.mtime = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) +
+                    st.st_mtim.tv_nsec;
+        char *reason = fb2_rejected(&key);
+        if(reason != NULL) {
+            /* Only files that claim to be books get a "Non FB2 file." */
+            if(fb2_named)
+                fb2_set_file_error(file, reason);
+            g_free(reason);
+            g_free(filename);
+            return NAUTILUS_OPERATION_COMPLETE;
+        }
+
+        /* Everything else, even a look at the first bytes, happens later */
+        UpdateHandle *update_handle = g_new0 (UpdateHandle, 1);
+        update_handle->update_complete = g_closure_ref(update_complete);
+        update_handle->provider = provider;
+        update_handle->file = g_object_ref (file);
+        update_handle->filename = filename;
+        update_handle->key = key;
+        update_handle->fb2_named = fb2_named;
+        if(fb2_idle_budget > 0)
+            fb2_queue_job(update_handle);
+        else
+            g_idle_add(timeout_fb2_callback, update_handle);
+        *handle = update_handle;
+        return NAUTILUS_OPERATION_IN_PROGRESS;
     }
     nautilus_file_info_add_string_attribute(file,
                                             "FB2Extension::fb2_data",
@@ -292,6 +369,9 @@ void nautilus_module_initialize (GTypeModule  *module)
 {
     fb2_extension_register_type(module);
     provider_types[0] = fb2_extension_get_type();
+    const char *budget = g_getenv("FB2_EXTENSION_IDLE_BUDGET_MS");
+    if(budget != NULL)
+        fb2_idle_budget = (gint64)(g_ascii_strtod(budget, NULL) * 1000);
     xmlInitParser();
     LIBXML_TEST_VERSION
 }
@@ -299,6 +379,8 @@ void nautilus_module_initialize (GTypeModule  *module)
 void nautilus_module_shutdown(void)
 {
     /* Any module-specific shutdown */
+    fb2_drop_jobs();
+    fb2_index_shutdown();
     xmlCleanupParser();
 }
 
@@ -308,74 +390,76 @@ void nautilus_module_list_types (const GType **types, int *num_types)
     *num_types = G_N_ELEMENTS (provider_types);
 }
 /* Callback for async */
-gint
-timeout_plain_fb2_callback(gpointer data)
-{
-    FB2Info info;
-    memset(&info, 0, sizeof(FB2Info));
-    UpdateHandle *handle = (UpdateHandle*)data;
-    if (!handle->cancelled) {
-        char *filename = g_file_get_path(nautilus_file_info_get_location(handle->file));
-        int result = read_from_plain_fb2(filename, &info);
-        if(result == FB2_RESULT_OK) {
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_data",
-                                                     (char*)info.title );
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_title",
-                                                    (char*)info.title);
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_lastname",
-                                                    (char*)info.last_name);
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_firstname",
-                                                    (char*)info.first_name);
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_sequence",
-                                                    (char*)info.sequence);
-            g_object_set_data(G_OBJECT (handle->file),
-                              "fb2_extension_fb2_sequence",
-                              (char*)info.sequence);
-        
-            /* Cache the data so that we don't have to read it again */
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_data",
-                                    g_strdup((char*)info.title),
-                                    g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_title",
-                                    g_strdup((char*)info.title),
-                                    g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_lastname",
-                                    g_strdup((char*)info.last_name),
-                                    g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_firstname",
-                                    g_strdup((char*)info.first_name),
-                                    g_free);
-            
-            clear_FB2Info(&info);
-        } else {
-            char *data_s = g_strdup_printf("%s, Code: %d", fb2_errors[result], result);
-            nautilus_file_info_add_string_attribute (handle->file,
-                                                    "FB2Extension::fb2_data",
-                                                     data_s);
-            nautilus_file_info_add_string_attribute (handle->file,
-                                                    "FB2Extension::fb2_title",
-                                                     data_s);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_data",
-                                    g_strdup(data_s),
-                                    g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_title",
-                                    data_s,
-                                    g_free);
-        }
-        g_free(filename);
+static void
+fb2_set_file_error(NautilusFileInfo *file, const char *message)
+{
+    nautilus_file_info_add_string_attribute (file,
+                                            "FB2Extension::fb2_data",
+                                             message);
+    nautilus_file_info_add_string_attribute (file,
+                                            "FB2Extension::fb2_title",
+                                             message);
+    g_object_set_data_full(G_OBJECT (file),
+                            "fb2_extension_fb2_data",
+                            g_strdup(message),
+                            g_free);
+    g_object_set_data_full(G_OBJECT (file),
+                            "fb2_extension_fb2_title",
+                            g_strdup(message),
+                            g_free);
+}
+
+static void
+fb2_set_file_info(NautilusFileInfo *file, int result, FB2Info *info)
+{
+    if(result == FB2_RESULT_OK) {
+        nautilus_file_info_add_string_attribute(file,
+                                                "FB2Extension::fb2_data",
+                                                 (char*)info->title );
+        nautilus_file_info_add_string_attribute(file,
+                                                "FB2Extension::fb2_title",
+                                                (char*)info->title);
+        nautilus_file_info_add_string_attribute(file,
+                                                "FB2Extension::fb2_lastname",
+                                                (char*)info->last_name);
+        nautilus_file_info_add_string_attribute(file,
+                                                "FB2Extension::fb2_firstname",
+                                                (char*)info->first_name);
+        nautilus_file_info_add_string_attribute(file,
+                                                "FB2Extension::fb2_sequence",
+                                                (char*)info->sequence);
+
+        /* Cache the data so that we don't have to read it again */
+        g_object_set_data_full(G_OBJECT (file),
+                                "fb2_extension_fb2_sequence",
+                                g_strdup((char*)info->sequence),
+                                g_free);
+        g_object_set_data_full(G_OBJECT (file),
+                                "fb2_extension_fb2_data",
+                                g_strdup((char*)info->title),
+                                g_free);
+        g_object_set_data_full(G_OBJECT (file),
+                                "fb2_extension_fb2_title",
+                                g_strdup((char*)info->title),
+                                g_free);
+        g_object_set_data_full(G_OBJECT (file),
+                                "fb2_extension_fb2_lastname",
+                                g_strdup((char*)info->last_name),
+                                g_free);
+        g_object_set_data_full(G_OBJECT (file),
+                                "fb2_extension_fb2_firstname",
+                                g_strdup((char*)info->first_name),
+                                g_free);
+    } else {
+        char *data_s = fb2_error_message(result);
+        fb2_set_file_error(file, data_s);
+        g_free(data_s);
     }
-    
+}
+
+static void
+fb2_update_complete(UpdateHandle *handle)
+{
     nautilus_info_provider_update_complete_invoke
                         (handle->update_complete,
                          handle->provider,
@@ -384,343 +468,414 @@ timeout_plain_fb2_callback(gpointer data)
     /* We're done with the handle */
     g_closure_unref (handle->update_complete);
     g_object_unref (handle->file);
+    g_free (handle->filename);
     g_free (handle);
-    return 0;
 }
 
-gint
-timeout_zip_fb2_callback(gpointer data)
-{
-    FB2Info info;
-    memset(&info, 0, sizeof(FB2Info));
-    UpdateHandle *handle = (UpdateHandle*)data;
-    if (!handle->cancelled) {
-        char *filename = g_file_get_path(nautilus_file_info_get_location(handle->file));
-        int result = read_from_zip_fb2(filename, &info);
-        if(result == FB2_RESULT_OK) {
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_data",
-                                                     (char*)info.title );
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_title",
-                                                    (char*)info.title);
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_lastname",
-                                                    (char*)info.last_name);
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_firstname",
-                                                    (char*)info.first_name);
-            nautilus_file_info_add_string_attribute(handle->file,
-                                                    "FB2Extension::fb2_sequence",
-                                                    (char*)info.sequence);
-            g_object_set_data(G_OBJECT (handle->file),
-                                  "fb2_extension_fb2_sequence",
-                                  (char*)info.sequence);
-        
-            /* Cache the data so that we don't have to read it again */
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                            "fb2_extension_fb2_data",
-                                            g_strdup((char*)info.title),
-                                            g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                            "fb2_extension_fb2_title",
-                                            g_strdup((char*)info.title),
-                                            g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                            "fb2_extension_fb2_lastname",
-                                            g_strdup((char*)info.last_name),
-                                            g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                            "fb2_extension_fb2_firstname",
-                                            g_strdup((char*)info.first_name),
-                                            g_free);
-            
-            clear_FB2Info(&info);
-        } else {
-            char *data_s = g_strdup_printf("%s, Code: %d", fb2_errors[result], result);
-            nautilus_file_info_add_string_attribute (handle->file,
-                                                    "FB2Extension::fb2_data",
-                                                     data_s);
-            nautilus_file_info_add_string_attribute (handle->file,
-                                                    "FB2Extension::fb2_title",
-                                                     data_s);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_data",
-                                    g_strdup(data_s),
-                                    g_free);
-            g_object_set_data_full(G_OBJECT (handle->file), 
-                                    "fb2_extension_fb2_title",
-                                    data_s,
-                                    g_free);
-        }
-        g_free(filename);
+static void
+fb2_finish(UpdateHandle *handle, const char *filename, int result, FB2Info *info)
+{
+    /* Generic XML, archives and binaries stay without columns */
+    if(result == FB2_RESULT_OK || handle->fb2_named)
+        fb2_set_file_info(handle->file, result, info);
+    if(result == FB2_RESULT_OK) {
+        fb2_index_book(filename, &handle->key, info);
+    } else if(fb2_is_final_error(result)) {
+        char *reason = fb2_error_message(result);
+        fb2_index_remove_book(filename);
+        fb2_reject(&handle->key, filename, reason);
+        g_free(reason);
     }
-    
-    nautilus_info_provider_update_complete_invoke
-                                                (handle->update_complete,
-                                                 handle->provider,
-                                                 (NautilusOperationHandle*)handle,
-                                                 NAUTILUS_OPERATION_COMPLETE);
-    /* We're done with the handle */
-    g_closure_unref (handle->update_complete);
-    g_object_unref (handle->file);
-    g_free (handle);
-    return 0;
 }
-/* Fb2 */
-static int 
-read_from_plain_fb2(const char* filename, FB2Info *info)
+
+/* Cooperative parsing.
+   Without threads a callback that parses a whole book blocks the main loop
+   for as long as the book takes. Instead every book is a resumable
+   FB2Parser (see fb2-parse.h) fed one chunk at a time; each idle tick steps
+   the active jobs round-robin until the tick budget is spent.
+   Only a few jobs are active at once, so the first files of a big folder are
+   not held back by the rest and few partial documents are kept in memory. */
+static void
+fb2_job_free(FB2Job *job, gboolean complete)
+{
+    if(complete) {
+        if(!job->handle->cancelled)
+            fb2_finish(job->handle, job->handle->filename,
+                       fb2_parser_result(job->parser), fb2_parser_info(job->parser));
+        fb2_update_complete(job->handle);
+    } else {
+        g_closure_unref (job->handle->update_complete);
+        g_object_unref (job->handle->file);
+        g_free (job->handle->filename);
+        g_free (job->handle);
+    }
+    fb2_parser_free(job->parser);
+    g_free(job);
+}
+
+/* TRUE when the job is done */
+static gboolean
+fb2_job_step(FB2Job *job)
+{
+    if(job->handle->cancelled)
+        return TRUE;
+    return fb2_parser_step(job->parser);
+}
+
+static FB2Job *
+fb2_job_new(UpdateHandle *handle)
+{
+    FB2Job *job = g_new0(FB2Job, 1);
+    job->handle = handle;
+    job->parser = fb2_parser_new(handle->filename, handle->fb2_named);
+    return job;
+}
+
+static gboolean
+fb2_jobs_idle_callback(gpointer data)
 {
-    assert(filename);
-    xmlDocPtr doc;
+    gint64 now = g_get_monotonic_time();
+    const gint64 deadline = now + fb2_idle_budget;
+    /* Longest step of this tick. The next one starts only if another step
+       that long still fits, the first one always runs. */
+    gint64 longest = 0;
+    do {
+        while(g_queue_get_length(&fb2_active_jobs) < FB2_MAX_ACTIVE_JOBS &&
+              !g_queue_is_empty(&fb2_pending_jobs))
+            g_queue_push_tail(&fb2_active_jobs, g_queue_pop_head(&fb2_pending_jobs));
+
+        FB2Job *job = g_queue_pop_head(&fb2_active_jobs);
+        if(fb2_job_step(job))
+            fb2_job_free(job, TRUE);
+        else
+            g_queue_push_tail(&fb2_active_jobs, job);
+
+        const gint64 then = now;
+        now = g_get_monotonic_time();
+        longest = MAX(longest, now - then);
+    } while((!g_queue_is_empty(&fb2_active_jobs) || !g_queue_is_empty(&fb2_pending_jobs)) &&
+            now + longest < deadline);
 
-    /* Load XML document */
-    doc = xmlParseFile(filename);
-    if (doc == NULL) {
-        return(FB2_RESULT_INVALID_FB2);
+    if(g_queue_is_empty(&fb2_active_jobs) && g_queue_is_empty(&fb2_pending_jobs)) {
+        fb2_jobs_source = 0;
+        return FALSE;
     }
+    return TRUE;
+}
+
+static void
+fb2_queue_job(UpdateHandle *handle)
+{
+    g_queue_push_tail(&fb2_pending_jobs, fb2_job_new(handle));
+    if(fb2_jobs_source == 0)
+        fb2_jobs_source = g_idle_add(fb2_jobs_idle_callback, NULL);
+}
+
+/* FB2_EXTENSION_IDLE_BUDGET_MS=0: the same job, run to the end at once */
+gint
+timeout_fb2_callback(gpointer data)
+{
+    FB2Job *job = fb2_job_new((UpdateHandle*)data);
+    while(!fb2_job_step(job))
+        ;
+    fb2_job_free(job, TRUE);
+    return 0;
+}
 
-    int result = process_xml(doc, info);
-
-    /* free the document */
-    xmlFreeDoc(doc); 
-    
-    return(result);
-}
-
-static int
-read_from_zip_fb2(const char *archive, FB2Info *info)
-{
-    int result = FB2_RESULT_OK; /* Result for operation */
-    /* Zip error */
-    int err = 0;
-    char errbuf[100];
-    char *dataEntry;
-    /* Zip */
-    struct zip *za;
-    struct zip_file *zf;
-    struct zip_stat sb;
-    /* For files in zip */
-    zip_int64_t num64; /* Number of files */
-    zip_uint64_t i;    /* Counter, for 0..num64 */
-    zip_uint64_t uncomp_size; /* Zize of uncompressed file */
-    zip_int64_t fread_len; /* Really read bytes from zipped file. */
-    size_t len;
-    if ((za = zip_open(archive, 0, &err)) == NULL) {
-        zip_error_to_str(errbuf, sizeof(errbuf), err, errno);
-        return FB2_RESULT_ZIP_CANT_OPEN;
+static void
+fb2_drop_jobs(void)
+{
+    FB2Job *job;
+    if(fb2_jobs_source != 0) {
+        g_source_remove(fb2_jobs_source);
+        fb2_jobs_source = 0;
     }
-    num64 = zip_get_num_entries(za, 0);
-    for (i = 0; i < num64; ++i) {
-        zip_stat_init(&sb);
-        if (zip_stat_index(za, i, 0, &sb) == 0) {
-            len = strlen(sb.name);
-            uncomp_size = sb.size;
-            if (sb.name[len-1] == '/') {
-                //safe_create_dir(sb.name);
-                ;
-            } else {
-                if(len > 4 && g_strcmp0(&sb.name[len-4], ".fb2") == 0) {
-                    zf = zip_fopen_index(za, i, 0);
-                    if(!zf) {
-                        zip_close(za);
-                        return(FB2_RESULT_ZIP_OPEN_FILE_ERR);
-                    }
-                    /* Cast to size_t conversion safe (for malloc).*/
-                    if(SIZE_MAX < uncomp_size+1) {
-                        zip_close(za);
-                        return(FB2_RESULT_ZIP_OPEN_FILE_ERR);
-                    }
-                    /* Conversion from zip_uint64_t to size_t is bad, but no way.*/
-                    dataEntry = (char *)g_malloc0((size_t)uncomp_size+1);
-                    if(dataEntry != NULL) {
-                        fread_len = zip_fread(zf, dataEntry, uncomp_size);
-                        if(fread_len < 0) {
-                            zip_fclose(zf);
-                            g_free(dataEntry);
-                            zip_close(za);
-                            return(FB2_RESULT_ZIP_READ_FILE_ERR);
-                        }
-                        if((zip_uint64_t)fread_len < uncomp_size) {
-                            zip_fclose(zf);
-                            g_free(dataEntry);
-                            zip_close(za);
-                            return(FB2_RESULT_ZIP_READ_FILE_ERR);
-                        }
-                        result = parse_xml_from_buffer(dataEntry, uncomp_size, info);
-                        zip_fclose(zf);
-                        g_free(dataEntry);
-                        break;
-                    }
-                }
+    while((job = g_queue_pop_head(&fb2_active_jobs)) != NULL)
+        fb2_job_free(job, FALSE);
+    while((job = g_queue_pop_head(&fb2_pending_jobs)) != NULL)
+        fb2_job_free(job, FALSE);
+}
+/* Search index.
+   SQLite writes, and the FTS5 merges behind them, can take tens of
+   milliseconds, far more than one idle slice. They run on a writer thread
+   which owns the database; the main loop only queues copies of what to
+   write. The writer commits as soon as it has caught up with the queue,
+   or after FB2_INDEX_MAX_BATCH writes, so writes batch up only while they
+   keep coming and no transaction stays open to lock out fb2-query. */
+static void
+fb2_index_op_free(gpointer data)
+{
+    FB2IndexOp *op = data;
+    g_free((char*)op->book.path);
+    g_free((char*)op->book.title);
+    g_free((char*)op->book.first_name);
+    g_free((char*)op->book.middle_name);
+    g_free((char*)op->book.last_name);
+    g_free((char*)op->book.sequence_name);
+    g_free((char*)op->book.sequence_number);
+    g_free((char*)op->book.genres);
+    g_free((char*)op->reject.path);
+    g_free((char*)op->reject.reason);
+    g_free(op);
+}
+
+static void fb2_rejects_load(const FB2IndexReject *reject, void *user_data);
+
+static gpointer
+fb2_index_writer(gpointer data)
+{
+    char *path = data;
+    FB2Index *index = fb2_index_open(path, FB2_INDEX_MIGRATE, NULL);
+    free(path);
+    if(index != NULL) {
+        /* Deleted and replaced files would pile up otherwise */
+        fb2_index_prune_rejects(index);
+        fb2_index_rejects(index, FB2_MAX_REJECTS, fb2_rejects_load, NULL);
+    } else {
+        g_warning("fb2-extension: can't open the search index");
+    }
+
+    guint batched = 0;
+    for(;;) {
+        FB2IndexOp *op = g_async_queue_pop(fb2_index_queue);
+        if(op->type == FB2_INDEX_OP_QUIT) {
+            fb2_index_op_free(op);
+            break;
+        }
+        if(index != NULL) {
+            switch(op->type) {
+            case FB2_INDEX_OP_PUT:
+                fb2_index_put(index, &op->book);
+                break;
+            case FB2_INDEX_OP_REMOVE:
+                fb2_index_remove(index, op->book.path);
+                break;
+            case FB2_INDEX_OP_REJECT:
+                fb2_index_reject(index, &op->reject);
+                break;
+            case FB2_INDEX_OP_UNREJECT:
+                fb2_index_unreject(index, op->reject.device, op->reject.inode);
+                break;
+            default:
+                break;
             }
+            ++batched;
+        }
+        fb2_index_op_free(op);
+        if(batched >= FB2_INDEX_MAX_BATCH ||
+           (batched > 0 && g_async_queue_length(fb2_index_queue) <= 0)) {
+            fb2_index_flush(index);
+            batched = 0;
         }
     }
-    if (zip_close(za) == -1) {
-        return(FB2_RESULT_ZIP_CANT_CLOSE);
-    }
-    return result;
+    fb2_index_close(index);
+    return NULL;
 }
 
-static int
-parse_xml_from_buffer(char *content, zip_uint64_t uncomp_size, FB2Info *info)
+/* Starts the writer on first use, FB2_EXTENSION_INDEX="" turns it off */
+static gboolean
+fb2_index_start(void)
 {
-    assert(content);
-    assert(info);
-    xmlDocPtr doc;
-    
-    doc = xmlReadMemory(content, (size_t)uncomp_size, "fb2.xml", NULL,
-            XML_PARSE_NOERROR | XML_PARSE_NOWARNING | XML_PARSE_RECOVER);
-    if (doc == NULL) {
-        return(FB2_RESULT_UNABLE_PARSE_MEM_BUFF);
+    if(fb2_index_thread == NULL && !fb2_index_disabled) {
+        char *path = fb2_index_default_path();
+        if(path == NULL || path[0] == '\0') {
+            free(path);
+            fb2_index_disabled = TRUE;
+            return FALSE;
+        }
+        fb2_index_queue = g_async_queue_new_full(fb2_index_op_free);
+        fb2_index_thread = g_thread_new("fb2-index", fb2_index_writer, path);
     }
+    return fb2_index_thread != NULL;
+}
+
+static void
+fb2_index_push(FB2IndexOp *op)
+{
+    if(fb2_index_start())
+        g_async_queue_push(fb2_index_queue, op);
+    else
+        fb2_index_op_free(op);
+}
 
-    const int result = process_xml(doc, info);
+static void
+fb2_index_book(const char *filename, const FB2FileKey *key, FB2Info *info)
+{
+    if(filename == NULL)
+        return;
+    FB2IndexOp *op = g_new0(FB2IndexOp, 1);
+    op->type = FB2_INDEX_OP_PUT;
+    op->book.path = g_strdup(filename);
+    op->book.size = key->size;
+    op->book.mtime = key->mtime;
+    op->book.title = g_strdup((const char*)info->title);
+    op->book.first_name = g_strdup((const char*)info->first_name);
+    op->book.middle_name = g_strdup((const char*)info->middle_name);
+    op->book.last_name = g_strdup((const char*)info->last_name);
+    op->book.sequence_name = g_strdup((const char*)info->sequence_name);
+    op->book.sequence_number = g_strdup((const char*)info->sequence_number);
+    op->book.genres = g_strdup((const char*)info->genres);
+    fb2_index_push(op);
+}
 
-    /* free the document */
-    xmlFreeDoc(doc);
-    return(result);
+/* A book that no longer parses must not be found by fb2-query */
+static void
+fb2_index_remove_book(const char *filename)
+{
+    if(filename == NULL)
+        return;
+    FB2IndexOp *op = g_new0(FB2IndexOp, 1);
+    op->type = FB2_INDEX_OP_REMOVE;
+    op->book.path = g_strdup(filename);
+    fb2_index_push(op);
 }
 
-static xmlXPathObjectPtr
-getnodeset (xmlDocPtr doc, xmlXPathContextPtr context, const xmlChar *xpath)
+static void
+fb2_index_shutdown(void)
 {
-    assert(doc);
-    assert(context);
-    asser(xpath);
-    xmlXPathObjectPtr result = NULL;
-    if (context == NULL)
-    {
-#ifdef DEBUG
-        fprintf(stderr, "Error in xmlXPathNewContext\n");
-#endif
-        return NULL;
-    }
-    result = xmlXPathEvalExpression(xpath, context);
-    if (result == NULL)
-    {
-#ifdef DEBUG
-        fprintf(stderr, "Error in xmlXPathEvalExpression\n");
-#endif
-        return NULL;
+    if(fb2_index_thread != NULL) {
+        FB2IndexOp *op = g_new0(FB2IndexOp, 1);
+        op->type = FB2_INDEX_OP_QUIT;
+        g_async_queue_push(fb2_index_queue, op);
+        g_thread_join(fb2_index_thread);
+        fb2_index_thread = NULL;
+        g_async_queue_unref(fb2_index_queue);
+        fb2_index_queue = NULL;
     }
-    if(xmlXPathNodeSetIsEmpty(result->nodesetval) )
-    {
-        xmlXPathFreeObject(result);
-#ifdef DEBUG
-        fprintf(stderr, "No result\n");
-#endif
-        return NULL;
-    }
-    return result;
-}
-
-static int
-process_xml(xmlDocPtr doc, FB2Info *info)
-{
-    assert(doc);
-    assert(info);
-    xmlXPathContextPtr xpathCtx;
-    xpathCtx = xmlXPathNewContext(doc);
-    if(xpathCtx == NULL)
-    {
-#ifdef DEBUG
-        fprintf(stderr, "Can't create XPATH context for XML document.\n");
-#endif
-        return FB2_RESULT_UNABLE_CREATE_XPATH_CONTEXT;
+    g_mutex_lock(&fb2_rejects_lock);
+    if(fb2_rejects != NULL) {
+        g_hash_table_destroy(fb2_rejects);
+        fb2_rejects = NULL;
+        g_queue_init(&fb2_rejects_lru);
     }
+    g_mutex_unlock(&fb2_rejects_lock);
+}
 
-    xmlXPathRegisterNs(xpathCtx, BAD_CAST "fb2", BAD_CAST "http://www.gribuser.ru/xml/fictionbook/2.0");
-
-    xmlNodeSetPtr nodeset;
-    xmlXPathObjectPtr result;
-    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:book-title");
-    if (result)
-    {
-        nodeset = result->nodesetval;
-        info->title = xmlNodeListGetString(doc, nodeset->nodeTab[0]->xmlChildrenNode, 1);
-#ifdef DEBUG
-        fprintf(stderr, "title: %s\n", info->title);
-#endif // DEBUG
-        xmlXPathFreeObject (result);
-    }
-    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:author");
-    if (result)
-    {
-        nodeset = result->nodesetval;
-#ifdef DEBUG
-        fprintf(stderr, "NUM OF AUTHORS: %d\n", nodeset->nodeNr);
-#endif // DEBUG
-        for (int i=0; i < nodeset->nodeNr; ++i)
-        {
-            xmlNodePtr author_node = nodeset->nodeTab[i];
-            xmlNode *cur_node = NULL;
-            for (cur_node = author_node->xmlChildrenNode; cur_node; cur_node = cur_node->next)
-            {
-                if (cur_node->type == XML_ELEMENT_NODE)
-                {
-                    if(xmlStrcmp(cur_node->name, (const xmlChar *)"first-name") == 0)
-                    {
-                        //info->first_name = xmlNodeListGetString(doc, cur_node->xmlChildrenNod, 1);
-                        info->first_name = xmlXPathCastNodeToString(cur_node); // Also xmlNodeGetContent(cur_node)
-                    }
-                    if(xmlStrcmp(cur_node->name, (const xmlChar *)"last-name") == 0)
-                    {
-                        info->last_name = xmlXPathCastNodeToString(cur_node); // Also xmlNodeGetContent(cur_node)
-                    }
-                    if(xmlStrcmp(cur_node->name, (const xmlChar *)"middle-name") == 0)
-                    {
-                        info->middle_name = xmlXPathCastNodeToString(cur_node); // Also xmlNodeGetContent(cur_node)
-                    }
-                }
-            }
-        }
-        xmlXPathFreeObject (result);
-    }
+/* Negative cache.
+   Files that turned out not to be books, or broken ones, are remembered by
+   device and inode together with size and mtime, so the next visit costs a
+   stat and a hash lookup. Any change to the file gives it another chance.
+   All of them are stored in the database, generic XML, archives and binaries
+   too: those are most of what a share holds besides books, and without them
+   every restart would open each one again. In memory the cache is an LRU of
+   FB2_MAX_REJECTS entries; the database rows of files that are gone are
+   pruned by the writer thread when it starts.
+   The writer thread fills the table from the database while the main loop
+   already uses it, hence the lock. */
+static guint
+fb2_file_key_hash(gconstpointer v)
+{
+    const FB2FileKey *key = v;
+    return (guint)(key->inode ^ (key->inode >> 32) ^ (key->device * 16777619u));
+}
 
-//  result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:genre");
-//  if (result) {
-//      xmlChar *keyword = NULL;
-//      nodeset = result->nodesetval;
-//      for (int i=0; i < nodeset->nodeNr; i++) {
-//          keyword = xmlNodeListGetString(doc, nodeset->nodeTab[i]->xmlChildrenNode, 1);
-//      #ifdef DEBUG
-//          fprintf(stderr, "Genre: %s\n", keyword);
-//      #endif // DEBUG
-//      xmlFree(keyword);
-//      }
-//      xmlXPathFreeObject (result);
-//  }
-
-    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:sequence");
-    if (result)
-    {
-        nodeset = result->nodesetval;
-        xmlNodePtr sequence_node = nodeset->nodeTab[0];
-        xmlChar *sequence_name = xmlGetProp(sequence_node, (const xmlChar *)"name");
-        xmlChar *sequence_number = xmlGetProp(sequence_node, (const xmlChar *)"number");
-#ifdef DEBUG
-//        fprintf(stderr, "Sequence: %s-%s\n", sequence_name, sequence_number);
-#endif // DEBUG
-        if(sequence_number)
-            xmlStrPrintf(info->sequence, LEN_SEQUENCE_STR, "%s - %s", sequence_name, sequence_number);
-        else
-            xmlStrPrintf(info->sequence, LEN_SEQUENCE_STR, "%s", sequence_name);
+static gboolean
+fb2_file_key_equal(gconstpointer a, gconstpointer b)
+{
+    const FB2FileKey *x = a;
+    const FB2FileKey *y = b;
+    return x->device == y->device && x->inode == y->inode;
+}
 
-        xmlFree(sequence_name);
-        xmlFree(sequence_number);
-        xmlXPathFreeObject (result);
+/* Call with fb2_rejects_lock held */
+static GHashTable *
+fb2_get_rejects(void)
+{
+    if(fb2_rejects == NULL)
+        fb2_rejects = g_hash_table_new_full(fb2_file_key_hash, fb2_file_key_equal,
+                                            NULL, g_free);
+    return fb2_rejects;
+}
+
+/* Call with fb2_rejects_lock held */
+static void
+fb2_rejects_remove(FB2Reject *reject)
+{
+    g_queue_unlink(&fb2_rejects_lru, &reject->link);
+    g_hash_table_remove(fb2_rejects, &reject->key);
+}
+
+/* Call with fb2_rejects_lock held. Recent entries go to the head of the
+   LRU, ones loaded from the database to its tail. */
+static void
+fb2_rejects_add(const FB2FileKey *key, const char *reason, gboolean recent)
+{
+    FB2Reject *reject = g_hash_table_lookup(fb2_get_rejects(), key);
+    if(reject != NULL)
+        fb2_rejects_remove(reject);
+    reject = g_new0(FB2Reject, 1);
+    reject->key = *key;
+    /* A handful of different messages */
+    reject->reason = g_intern_string(reason);
+    reject->link.data = reject;
+    g_hash_table_insert(fb2_rejects, &reject->key, reject);
+    if(recent)
+        g_queue_push_head_link(&fb2_rejects_lru, &reject->link);
+    else
+        g_queue_push_tail_link(&fb2_rejects_lru, &reject->link);
+    if(fb2_rejects_lru.length > FB2_MAX_REJECTS)
+        fb2_rejects_remove(fb2_rejects_lru.tail->data);
+}
+
+/* Writer thread. Entries the main loop added meanwhile are newer. */
+static void
+fb2_rejects_load(const FB2IndexReject *reject, void *user_data)
+{
+    FB2FileKey key;
+    key.device = (guint64)reject->device;
+    key.inode = (guint64)reject->inode;
+    key.size = reject->size;
+    key.mtime = reject->mtime;
+    g_mutex_lock(&fb2_rejects_lock);
+    if(!g_hash_table_contains(fb2_get_rejects(), &key) &&
+       fb2_rejects_lru.length < FB2_MAX_REJECTS)
+        fb2_rejects_add(&key, reject->reason ? reject->reason : fb2_errors[FB2_RESULT_NOT_FB2], FALSE);
+    g_mutex_unlock(&fb2_rejects_lock);
+}
+
+/* Returns the reason as a new string, or NULL */
+static char *
+fb2_rejected(const FB2FileKey *key)
+{
+    char *reason = NULL;
+    gboolean changed = FALSE;
+    fb2_index_start();
+    g_mutex_lock(&fb2_rejects_lock);
+    FB2Reject *reject = g_hash_table_lookup(fb2_get_rejects(), key);
+    if(reject != NULL) {
+        if(reject->key.size == key->size && reject->key.mtime == key->mtime) {
+            reason = g_strdup(reject->reason);
+            g_queue_unlink(&fb2_rejects_lru, &reject->link);
+            g_queue_push_head_link(&fb2_rejects_lru, &reject->link);
+        } else {
+            fb2_rejects_remove(reject);
+            changed = TRUE;
+        }
+    }
+    g_mutex_unlock(&fb2_rejects_lock);
+    if(changed) {
+        FB2IndexOp *op = g_new0(FB2IndexOp, 1);
+        op->type = FB2_INDEX_OP_UNREJECT;
+        op->reject.device = (int64_t)key->device;
+        op->reject.inode = (int64_t)key->inode;
+        fb2_index_push(op);
     }
-    xmlXPathFreeContext(xpathCtx);
-    return FB2_RESULT_OK;
+    return reason;
 }
 
 static void
-clear_FB2Info(FB2Info *info)
+fb2_reject(const FB2FileKey *key, const char *filename, const char *reason)
 {
-    assert(info);
-    if(info->title != NULL) xmlFree(info->title);
-    if(info->first_name != NULL) xmlFree(info->first_name);
-    if(info->last_name != NULL) xmlFree(info->last_name);
-    if(info->middle_name != NULL) xmlFree(info->middle_name);
+    g_mutex_lock(&fb2_rejects_lock);
+    fb2_rejects_add(key, reason, TRUE);
+    g_mutex_unlock(&fb2_rejects_lock);
+    FB2IndexOp *op = g_new0(FB2IndexOp, 1);
+    op->type = FB2_INDEX_OP_REJECT;
+    op->reject.device = (int64_t)key->device;
+    op->reject.inode = (int64_t)key->inode;
+    op->reject.size = key->size;
+    op->reject.mtime = key->mtime;
+    op->reject.path = g_strdup(filename);
+    op->reject.reason = g_strdup(reason);
+    fb2_index_push(op);
 }
@@ -0,0 +1,856 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "fb2-index.h"
+
+struct _FB2Index
+{
+    sqlite3 *db;
+    sqlite3_stmt *upsert;
+    sqlite3_stmt *select_id;
+    sqlite3_stmt *delete_book;
+    sqlite3_stmt *delete_genres;
+    sqlite3_stmt *insert_genre;
+    sqlite3_stmt *insert_reject;
+    sqlite3_stmt *delete_reject;
+    sqlite3_stmt *select_book_stamp;
+    sqlite3_stmt *select_reject_stamp;
+    int in_transaction;
+};
+
+/* FB2_INDEX_VERSION (fb2-index.h) is kept in PRAGMA user_version. The index
+   is a cache: the extension drops an old one and refills it as Nautilus
+   visits the books again. Nothing else may drop it. */
+static const char fb2_index_drop[] =
+    "DROP TABLE IF EXISTS books_fts;"
+    "DROP TABLE IF EXISTS author_counts;"
+    "DROP TABLE IF EXISTS sequence_counts;"
+    "DROP TABLE IF EXISTS genre_counts;"
+    "DROP TABLE IF EXISTS book_genres;"
+    "DROP TABLE IF EXISTS books;"
+    "DROP TABLE IF EXISTS rejects;";
+
+/* Author, title and sequence have a g_utf8_casefold()ed *_key copy so that
+   prefix facets are answered from an index for any script, not only ASCII
+   (SQLite's NOCASE and LIKE fold A-Z only). The author and sequence
+   indexes also cover the display name, for filtered facets.
+   Facets over the whole index read the *_counts tables, which triggers
+   keep up to date; counting 500k books each time takes a second. */
+static const char fb2_index_schema[] =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS books("
+    "  id INTEGER PRIMARY KEY,"
+    "  path TEXT NOT NULL UNIQUE,"
+    "  size INTEGER,"
+    "  mtime INTEGER,"
+    "  title TEXT,"
+    "  first_name TEXT,"
+    "  middle_name TEXT,"
+    "  last_name TEXT,"
+    "  author TEXT,"
+    "  sequence TEXT,"
+    "  sequence_number INTEGER,"
+    "  genres TEXT,"
+    "  title_key TEXT,"
+    "  author_key TEXT,"
+    "  sequence_key TEXT);"
+    "CREATE INDEX IF NOT EXISTS books_author ON books(author_key, author);"
+    "CREATE INDEX IF NOT EXISTS books_title ON books(title_key);"
+    "CREATE INDEX IF NOT EXISTS books_sequence ON books(sequence_key, sequence_number, sequence);"
+    "CREATE TABLE IF NOT EXISTS book_genres("
+    "  genre TEXT NOT NULL,"
+    "  book_id INTEGER NOT NULL,"
+    "  PRIMARY KEY(genre, book_id)) WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS book_genres_book ON book_genres(book_id);"
+    "CREATE TABLE IF NOT EXISTS author_counts("
+    "  key TEXT PRIMARY KEY, name TEXT, count INTEGER NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS author_counts_count ON author_counts(count DESC, name);"
+    "CREATE TABLE IF NOT EXISTS sequence_counts("
+    "  key TEXT PRIMARY KEY, name TEXT, count INTEGER NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS sequence_counts_count ON sequence_counts(count DESC, name);"
+    "CREATE TABLE IF NOT EXISTS genre_counts("
+    "  key TEXT PRIMARY KEY, name TEXT, count INTEGER NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS genre_counts_count ON genre_counts(count DESC, name);"
+    "CREATE TABLE IF NOT EXISTS rejects("
+    "  device INTEGER NOT NULL,"
+    "  inode INTEGER NOT NULL,"
+    "  size INTEGER NOT NULL,"
+    "  mtime INTEGER NOT NULL,"
+    "  path TEXT,"
+    "  reason TEXT,"
+    "  PRIMARY KEY(device, inode));"
+    "CREATE VIRTUAL TABLE IF NOT EXISTS books_fts USING fts5("
+    "  title, author, sequence, genres,"
+    "  content='books', content_rowid='id',"
+    "  tokenize='unicode61 remove_diacritics 2', prefix='1 2 3');"
+    "CREATE TRIGGER IF NOT EXISTS books_ai AFTER INSERT ON books BEGIN"
+    "  INSERT INTO books_fts(rowid, title, author, sequence, genres)"
+    "  VALUES (new.id, new.title, new.author, new.sequence, new.genres);"
+    "  INSERT INTO author_counts(key, name, count)"
+    "  SELECT new.author_key, new.author, 1 WHERE new.author_key IS NOT NULL"
+    "  ON CONFLICT(key) DO UPDATE SET count = count + 1;"
+    "  INSERT INTO sequence_counts(key, name, count)"
+    "  SELECT new.sequence_key, new.sequence, 1 WHERE new.sequence_key IS NOT NULL"
+    "  ON CONFLICT(key) DO UPDATE SET count = count + 1;"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS books_ad AFTER DELETE ON books BEGIN"
+    "  INSERT INTO books_fts(books_fts, rowid, title, author, sequence, genres)"
+    "  VALUES ('delete', old.id, old.title, old.author, old.sequence, old.genres);"
+    "  DELETE FROM book_genres WHERE book_id = old.id;"
+    "  UPDATE author_counts SET count = count - 1 WHERE key = old.author_key;"
+    "  DELETE FROM author_counts WHERE key = old.author_key AND count <= 0;"
+    "  UPDATE sequence_counts SET count = count - 1 WHERE key = old.sequence_key;"
+    "  DELETE FROM sequence_counts WHERE key = old.sequence_key AND count <= 0;"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS books_au AFTER UPDATE ON books BEGIN"
+    "  INSERT INTO books_fts(books_fts, rowid, title, author, sequence, genres)"
+    "  VALUES ('delete', old.id, old.title, old.author, old.sequence, old.genres);"
+    "  INSERT INTO books_fts(rowid, title, author, sequence, genres)"
+    "  VALUES (new.id, new.title, new.author, new.sequence, new.genres);"
+    "  UPDATE author_counts SET count = count - 1 WHERE key = old.author_key;"
+    "  DELETE FROM author_counts WHERE key = old.author_key AND count <= 0;"
+    "  UPDATE sequence_counts SET count = count - 1 WHERE key = old.sequence_key;"
+    "  DELETE FROM sequence_counts WHERE key = old.sequence_key AND count <= 0;"
+    "  INSERT INTO author_counts(key, name, count)"
+    "  SELECT new.author_key, new.author, 1 WHERE new.author_key IS NOT NULL"
+    "  ON CONFLICT(key) DO UPDATE SET count = count + 1;"
+    "  INSERT INTO sequence_counts(key, name, count)"
+    "  SELECT new.sequence_key, new.sequence, 1 WHERE new.sequence_key IS NOT NULL"
+    "  ON CONFLICT(key) DO UPDATE SET count = count + 1;"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS book_genres_ai AFTER INSERT ON book_genres BEGIN"
+    "  INSERT INTO genre_counts(key, name, count) VALUES (new.genre, new.genre, 1)"
+    "  ON CONFLICT(key) DO UPDATE SET count = count + 1;"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS book_genres_ad AFTER DELETE ON book_genres BEGIN"
+    "  UPDATE genre_counts SET count = count - 1 WHERE key = old.genre;"
+    "  DELETE FROM genre_counts WHERE key = old.genre AND count <= 0;"
+    "END;";
+
+/* Unchanged books are not rewritten, Nautilus asks again on every visit. */
+static const char fb2_index_upsert[] =
+    "INSERT INTO books(path, size, mtime, title, first_name, middle_name, last_name,"
+    "                  author, sequence, sequence_number, genres,"
+    "                  title_key, author_key, sequence_key)"
+    " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14)"
+    " ON CONFLICT(path) DO UPDATE SET"
+    "  size = excluded.size, mtime = excluded.mtime, title = excluded.title,"
+    "  first_name = excluded.first_name, middle_name = excluded.middle_name,"
+    "  last_name = excluded.last_name, author = excluded.author,"
+    "  sequence = excluded.sequence, sequence_number = excluded.sequence_number,"
+    "  genres = excluded.genres, title_key = excluded.title_key,"
+    "  author_key = excluded.author_key, sequence_key = excluded.sequence_key"
+    " WHERE (size, mtime, title, first_name, middle_name, last_name,"
+    "        author, sequence, sequence_number, genres) IS NOT"
+    "       (excluded.size, excluded.mtime, excluded.title, excluded.first_name,"
+    "        excluded.middle_name, excluded.last_name, excluded.author,"
+    "        excluded.sequence, excluded.sequence_number, excluded.genres);";
+
+static const char fb2_index_columns[] =
+    "path, size, mtime, title, first_name, middle_name, last_name,"
+    " author, sequence, sequence_number, genres";
+
+char *
+fb2_index_default_path(void)
+{
+    const char *path = getenv("FB2_EXTENSION_INDEX");
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *result;
+    size_t len;
+
+    if(path != NULL)
+        return strdup(path);
+    if((cache == NULL || cache[0] == '\0') && home == NULL)
+        return NULL;
+    len = (cache && cache[0] ? strlen(cache) : strlen(home) + strlen("/.cache"))
+          + strlen("/fb2-extension/index.db") + 1;
+    result = malloc(len);
+    if(result == NULL)
+        return NULL;
+    if(cache && cache[0])
+        snprintf(result, len, "%s/fb2-extension", cache);
+    else
+        snprintf(result, len, "%s/.cache/fb2-extension", home);
+    /* The cache directory itself may not exist yet either */
+    if(mkdir(result, 0700) != 0 && errno == ENOENT) {
+        char *slash = strrchr(result, '/');
+        *slash = '\0';
+        mkdir(result, 0700);
+        *slash = '/';
+        mkdir(result, 0700);
+    }
+    strcat(result, "/index.db");
+    return result;
+}
+
+static int
+get_version(FB2Index *index)
+{
+    sqlite3_stmt *stmt = NULL;
+    int version = -1;
+    if(sqlite3_prepare_v2(index->db, "PRAGMA user_version;", -1, &stmt, NULL) == SQLITE_OK &&
+       sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+static int
+is_empty(FB2Index *index)
+{
+    sqlite3_stmt *stmt = NULL;
+    int empty = 0;
+    if(sqlite3_prepare_v2(index->db, "SELECT count(*) FROM sqlite_master;", -1, &stmt, NULL) == SQLITE_OK &&
+       sqlite3_step(stmt) == SQLITE_ROW)
+        empty = sqlite3_column_int(stmt, 0) == 0;
+    sqlite3_finalize(stmt);
+    return empty;
+}
+
+FB2Index *
+fb2_index_open(const char *path, enum FB2_INDEX_MODE mode, int *version)
+{
+    assert(path);
+    if(version != NULL)
+        *version = -1;
+    FB2Index *index = calloc(1, sizeof(FB2Index));
+    if(index == NULL)
+        return NULL;
+    const int flags = mode == FB2_INDEX_READ_ONLY ? SQLITE_OPEN_READONLY :
+                                                    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    if(sqlite3_open_v2(path, &index->db, flags, NULL) != SQLITE_OK)
+        goto error;
+    /* Longer than any one commit of the other side, extension or fb2-query */
+    sqlite3_busy_timeout(index->db, 5000);
+    const int found = get_version(index);
+    if(version != NULL)
+        *version = found;
+    if(found < 0)
+        goto error;
+    if(found != FB2_INDEX_VERSION) {
+        if(mode != FB2_INDEX_MIGRATE && !(mode == FB2_INDEX_READ_WRITE && is_empty(index)))
+            goto error;
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA user_version=%d;", FB2_INDEX_VERSION);
+        if(sqlite3_exec(index->db, fb2_index_drop, NULL, NULL, NULL) != SQLITE_OK ||
+           sqlite3_exec(index->db, pragma, NULL, NULL, NULL) != SQLITE_OK)
+            goto error;
+    }
+    if(mode == FB2_INDEX_READ_ONLY)
+        return index;
+    if(sqlite3_exec(index->db, fb2_index_schema, NULL, NULL, NULL) != SQLITE_OK)
+        goto error;
+    if(sqlite3_prepare_v2(index->db, fb2_index_upsert, -1, &index->upsert, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "SELECT id FROM books WHERE path = ?1;", -1,
+                          &index->select_id, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "DELETE FROM books WHERE path = ?1;", -1,
+                          &index->delete_book, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "DELETE FROM book_genres WHERE book_id = ?1;", -1,
+                          &index->delete_genres, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "INSERT OR IGNORE INTO book_genres(genre, book_id) VALUES (?1, ?2);", -1,
+                          &index->insert_genre, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "INSERT OR REPLACE INTO rejects(device, inode, size, mtime, path, reason)"
+                                     " VALUES (?1, ?2, ?3, ?4, ?5, ?6);", -1,
+                          &index->insert_reject, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "DELETE FROM rejects WHERE device = ?1 AND inode = ?2;", -1,
+                          &index->delete_reject, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "SELECT 1 FROM books WHERE path = ?1 AND size = ?2 AND mtime = ?3;", -1,
+                          &index->select_book_stamp, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(index->db, "SELECT 1 FROM rejects WHERE device = ?1 AND inode = ?2"
+                                     " AND size = ?3 AND mtime = ?4;", -1,
+                          &index->select_reject_stamp, NULL) != SQLITE_OK)
+        goto error;
+    return index;
+
+error:
+#ifdef DEBUG
+    fprintf(stderr, "Can't open index %s: %s\n", path, sqlite3_errmsg(index->db));
+#endif
+    fb2_index_close(index);
+    return NULL;
+}
+
+void
+fb2_index_close(FB2Index *index)
+{
+    if(index == NULL)
+        return;
+    fb2_index_flush(index);
+    sqlite3_finalize(index->upsert);
+    sqlite3_finalize(index->select_id);
+    sqlite3_finalize(index->delete_book);
+    sqlite3_finalize(index->delete_genres);
+    sqlite3_finalize(index->insert_genre);
+    sqlite3_finalize(index->insert_reject);
+    sqlite3_finalize(index->delete_reject);
+    sqlite3_finalize(index->select_book_stamp);
+    sqlite3_finalize(index->select_reject_stamp);
+    sqlite3_close(index->db);
+    free(index);
+}
+
+const char *
+fb2_index_error(FB2Index *index)
+{
+    return index ? sqlite3_errmsg(index->db) : "out of memory";
+}
+
+static void
+bind_text_or_null(sqlite3_stmt *stmt, int column, const char *text)
+{
+    if(text != NULL && text[0] != '\0')
+        sqlite3_bind_text(stmt, column, text, -1, SQLITE_STATIC);
+    else
+        sqlite3_bind_null(stmt, column);
+}
+
+/* "Last First Middle" */
+static char *
+make_author(const FB2IndexBook *book)
+{
+    const char *parts[3] = { book->last_name, book->first_name, book->middle_name };
+    size_t len = 1;
+    for(int i = 0; i < 3; ++i)
+        if(parts[i] != NULL)
+            len += strlen(parts[i]) + 1;
+    char *author = malloc(len);
+    if(author == NULL)
+        return NULL;
+    author[0] = '\0';
+    for(int i = 0; i < 3; ++i) {
+        if(parts[i] == NULL || parts[i][0] == '\0')
+            continue;
+        if(author[0] != '\0')
+            strcat(author, " ");
+        strcat(author, parts[i]);
+    }
+    return author;
+}
+
+/* Case-insensitive key for any script. Returns a g_malloc'ed string or NULL. */
+static char *
+make_key(const char *text)
+{
+    if(text == NULL || text[0] == '\0')
+        return NULL;
+    if(!g_utf8_validate(text, -1, NULL))
+        return g_ascii_strdown(text, -1);
+    return g_utf8_casefold(text, -1);
+}
+
+static int
+put_genres(FB2Index *index, sqlite3_int64 id, const char *genres)
+{
+    sqlite3_bind_int64(index->delete_genres, 1, id);
+    sqlite3_step(index->delete_genres);
+    sqlite3_reset(index->delete_genres);
+    if(genres == NULL)
+        return 0;
+    const char *p = genres;
+    while(*p != '\0') {
+        while(*p == ' ')
+            ++p;
+        const char *end = p;
+        while(*end != '\0' && *end != ' ')
+            ++end;
+        if(end > p) {
+            sqlite3_bind_text(index->insert_genre, 1, p, (int)(end - p), SQLITE_STATIC);
+            sqlite3_bind_int64(index->insert_genre, 2, id);
+            const int rc = sqlite3_step(index->insert_genre);
+            sqlite3_reset(index->insert_genre);
+            if(rc != SQLITE_DONE)
+                return -1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+static int
+begin_batch(FB2Index *index)
+{
+    if(index->in_transaction)
+        return 0;
+    if(sqlite3_exec(index->db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+        return -1;
+    index->in_transaction = 1;
+    return 0;
+}
+
+int
+fb2_index_put(FB2Index *index, const FB2IndexBook *book)
+{
+    assert(index);
+    assert(book);
+    assert(book->path);
+    int result = -1;
+    if(begin_batch(index) != 0)
+        return -1;
+    char *author = make_author(book);
+    char *title_key = make_key(book->title);
+    char *author_key = make_key(author);
+    char *sequence_key = make_key(book->sequence_name);
+    sqlite3_stmt *stmt = index->upsert;
+    sqlite3_bind_text(stmt, 1, book->path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, book->size);
+    sqlite3_bind_int64(stmt, 3, book->mtime);
+    bind_text_or_null(stmt, 4, book->title);
+    bind_text_or_null(stmt, 5, book->first_name);
+    bind_text_or_null(stmt, 6, book->middle_name);
+    bind_text_or_null(stmt, 7, book->last_name);
+    bind_text_or_null(stmt, 8, author);
+    bind_text_or_null(stmt, 9, book->sequence_name);
+    bind_text_or_null(stmt, 10, book->sequence_number);
+    bind_text_or_null(stmt, 11, book->genres);
+    bind_text_or_null(stmt, 12, title_key);
+    bind_text_or_null(stmt, 13, author_key);
+    bind_text_or_null(stmt, 14, sequence_key);
+    if(sqlite3_step(stmt) == SQLITE_DONE) {
+        result = 0;
+        if(sqlite3_changes(index->db) > 0) {
+            sqlite3_bind_text(index->select_id, 1, book->path, -1, SQLITE_STATIC);
+            if(sqlite3_step(index->select_id) == SQLITE_ROW)
+                result = put_genres(index, sqlite3_column_int64(index->select_id, 0),
+                                    book->genres);
+            sqlite3_reset(index->select_id);
+        }
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    free(author);
+    g_free(title_key);
+    g_free(author_key);
+    g_free(sequence_key);
+    return result;
+}
+
+static const char *
+column_text(sqlite3_stmt *stmt, int column)
+{
+    return (const char *)sqlite3_column_text(stmt, column);
+}
+
+int
+fb2_index_remove(FB2Index *index, const char *path)
+{
+    assert(index);
+    assert(path);
+    if(begin_batch(index) != 0)
+        return -1;
+    sqlite3_stmt *stmt = index->delete_book;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    const int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/* Paths are collected first, deleting while stepping over the same table
+   is not well defined in SQLite. */
+int
+fb2_index_prune(FB2Index *index)
+{
+    assert(index);
+    sqlite3_stmt *stmt = NULL;
+    if(sqlite3_prepare_v2(index->db, "SELECT path FROM books;", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    char **gone = NULL;
+    size_t num_gone = 0;
+    size_t size = 0;
+    int rc;
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *path = column_text(stmt, 0);
+        struct stat st;
+        if(stat(path, &st) == 0 || errno != ENOENT)
+            continue;
+        if(num_gone == size) {
+            size = size ? size * 2 : 64;
+            char **more = realloc(gone, size * sizeof(char*));
+            if(more == NULL)
+                break;
+            gone = more;
+        }
+        gone[num_gone++] = strdup(path);
+    }
+    sqlite3_finalize(stmt);
+    int result = rc == SQLITE_DONE ? (int)num_gone : -1;
+    for(size_t i = 0; i < num_gone; ++i) {
+        if(result >= 0 && fb2_index_remove(index, gone[i]) != 0)
+            result = -1;
+        free(gone[i]);
+    }
+    free(gone);
+    if(fb2_index_flush(index) != 0)
+        result = -1;
+    return result;
+}
+
+int
+fb2_index_flush(FB2Index *index)
+{
+    assert(index);
+    if(!index->in_transaction)
+        return 0;
+    index->in_transaction = 0;
+    return sqlite3_exec(index->db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/* Negative cache */
+int
+fb2_index_reject(FB2Index *index, const FB2IndexReject *reject)
+{
+    assert(index);
+    assert(reject);
+    if(begin_batch(index) != 0)
+        return -1;
+    sqlite3_stmt *stmt = index->insert_reject;
+    sqlite3_bind_int64(stmt, 1, reject->device);
+    sqlite3_bind_int64(stmt, 2, reject->inode);
+    sqlite3_bind_int64(stmt, 3, reject->size);
+    sqlite3_bind_int64(stmt, 4, reject->mtime);
+    bind_text_or_null(stmt, 5, reject->path);
+    bind_text_or_null(stmt, 6, reject->reason);
+    const int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+int
+fb2_index_unreject(FB2Index *index, int64_t device, int64_t inode)
+{
+    assert(index);
+    if(begin_batch(index) != 0)
+        return -1;
+    sqlite3_stmt *stmt = index->delete_reject;
+    sqlite3_bind_int64(stmt, 1, device);
+    sqlite3_bind_int64(stmt, 2, inode);
+    const int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+int
+fb2_index_is_current(FB2Index *index, const char *path, int64_t device, int64_t inode,
+                     int64_t size, int64_t mtime)
+{
+    assert(index);
+    assert(path);
+    sqlite3_stmt *stmt = index->select_book_stamp;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, size);
+    sqlite3_bind_int64(stmt, 3, mtime);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if(rc == SQLITE_DONE) {
+        stmt = index->select_reject_stamp;
+        sqlite3_bind_int64(stmt, 1, device);
+        sqlite3_bind_int64(stmt, 2, inode);
+        sqlite3_bind_int64(stmt, 3, size);
+        sqlite3_bind_int64(stmt, 4, mtime);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    if(rc == SQLITE_ROW)
+        return 1;
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/* Collected first like in fb2_index_prune() */
+int
+fb2_index_prune_rejects(FB2Index *index)
+{
+    assert(index);
+    sqlite3_stmt *stmt = NULL;
+    if(sqlite3_prepare_v2(index->db, "SELECT device, inode, path FROM rejects;",
+                          -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    int64_t *gone = NULL;
+    size_t num_gone = 0;
+    size_t size = 0;
+    int rc;
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const int64_t device = sqlite3_column_int64(stmt, 0);
+        const int64_t inode = sqlite3_column_int64(stmt, 1);
+        const char *path = column_text(stmt, 2);
+        struct stat st;
+        if(path != NULL) {
+            if(stat(path, &st) == 0) {
+                if((int64_t)st.st_dev == device && (int64_t)st.st_ino == inode)
+                    continue;
+            } else if(errno != ENOENT) {
+                continue; /* Can't tell */
+            }
+        }
+        if(num_gone == size) {
+            size = size ? size * 2 : 64;
+            int64_t *more = realloc(gone, size * 2 * sizeof(int64_t));
+            if(more == NULL)
+                break;
+            gone = more;
+        }
+        gone[num_gone * 2] = device;
+        gone[num_gone * 2 + 1] = inode;
+        ++num_gone;
+    }
+    sqlite3_finalize(stmt);
+    int result = rc == SQLITE_DONE ? (int)num_gone : -1;
+    for(size_t i = 0; i < num_gone; ++i)
+        if(result >= 0 && fb2_index_unreject(index, gone[i * 2], gone[i * 2 + 1]) != 0)
+            result = -1;
+    free(gone);
+    if(fb2_index_flush(index) != 0)
+        result = -1;
+    return result;
+}
+
+/* Newest first: INSERT OR REPLACE gives a rewritten row a new rowid */
+int
+fb2_index_rejects(FB2Index *index, int limit, FB2IndexRejectFunc func, void *user_data)
+{
+    assert(index);
+    sqlite3_stmt *stmt = NULL;
+    if(sqlite3_prepare_v2(index->db, "SELECT device, inode, size, mtime, path, reason FROM rejects"
+                                     " ORDER BY rowid DESC LIMIT ?1;",
+                          -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_int(stmt, 1, limit > 0 ? limit : -1);
+    int count = 0;
+    int rc;
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        FB2IndexReject reject;
+        reject.device = sqlite3_column_int64(stmt, 0);
+        reject.inode = sqlite3_column_int64(stmt, 1);
+        reject.size = sqlite3_column_int64(stmt, 2);
+        reject.mtime = sqlite3_column_int64(stmt, 3);
+        reject.path = column_text(stmt, 4);
+        reject.reason = column_text(stmt, 5);
+        func(&reject, user_data);
+        ++count;
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
+
+/* Query building */
+#define FB2_INDEX_MAX_BINDS 8
+
+typedef struct
+{
+    char sql[1024];
+    char *binds[FB2_INDEX_MAX_BINDS];
+    int num_binds;
+} Fb2Sql;
+
+static void
+sql_append(Fb2Sql *sql, const char *text)
+{
+    strncat(sql->sql, text, sizeof(sql->sql) - strlen(sql->sql) - 1);
+}
+
+/* 'war pea' -> '"war"* "pea"*' */
+static char *
+make_match(const char *words)
+{
+    char *match = malloc(strlen(words) * 2 + 8 * (strlen(words) / 2 + 1) + 1);
+    char *out = match;
+    const char *p = words;
+    if(match == NULL)
+        return NULL;
+    while(*p != '\0') {
+        while(*p == ' ' || *p == '\t')
+            ++p;
+        if(*p == '\0')
+            break;
+        if(out != match)
+            *out++ = ' ';
+        *out++ = '"';
+        while(*p != '\0' && *p != ' ' && *p != '\t') {
+            if(*p == '"')
+                *out++ = '"';
+            *out++ = *p++;
+        }
+        *out++ = '"';
+        *out++ = '*';
+    }
+    *out = '\0';
+    if(out == match) {
+        free(match);
+        return NULL;
+    }
+    return match;
+}
+
+static void
+sql_filter(Fb2Sql *sql, const char *condition, char *bind)
+{
+    sql_append(sql, " AND ");
+    sql_append(sql, condition);
+    sql->binds[sql->num_binds++] = bind;
+}
+
+/* Prefix match on a *_key column as the range [key, key with its last
+   byte incremented), which SQLite answers from the column's index. */
+static void
+sql_prefix_filter(Fb2Sql *sql, const char *column, const char *prefix)
+{
+    char *key = make_key(prefix);
+    if(key == NULL)
+        return;
+    char *low = strdup(key);
+    char *high = strdup(key);
+    g_free(key);
+    /* Valid UTF-8 has no 0xff bytes, strip them from anything else */
+    size_t len = strlen(high);
+    while(len > 0 && (unsigned char)high[len - 1] == 0xff)
+        high[--len] = '\0';
+    char condition[96];
+    if(len == 0) {
+        free(high);
+        snprintf(condition, sizeof(condition), "%s >= ?", column);
+        sql_filter(sql, condition, low);
+        return;
+    }
+    high[len - 1]++;
+    snprintf(condition, sizeof(condition), "%s >= ? AND %s < ?", column, column);
+    sql_filter(sql, condition, low);
+    sql->binds[sql->num_binds++] = high;
+}
+
+static void
+sql_filters(Fb2Sql *sql, const FB2IndexQuery *query)
+{
+    sql_append(sql, " WHERE 1");
+    if(query->words != NULL) {
+        char *match = make_match(query->words);
+        if(match != NULL)
+            sql_filter(sql, "books.id IN (SELECT rowid FROM books_fts WHERE books_fts MATCH ?)", match);
+    }
+    if(query->author != NULL)
+        sql_prefix_filter(sql, "books.author_key", query->author);
+    if(query->title != NULL)
+        sql_prefix_filter(sql, "books.title_key", query->title);
+    if(query->sequence != NULL)
+        sql_prefix_filter(sql, "books.sequence_key", query->sequence);
+    if(query->genre != NULL)
+        sql_filter(sql, "books.id IN (SELECT book_id FROM book_genres WHERE genre = ?)",
+                   strdup(query->genre));
+}
+
+static sqlite3_stmt *
+sql_prepare(FB2Index *index, Fb2Sql *sql, int limit)
+{
+    sqlite3_stmt *stmt = NULL;
+    sql_append(sql, " LIMIT ?;");
+    if(sqlite3_prepare_v2(index->db, sql->sql, -1, &stmt, NULL) == SQLITE_OK) {
+        for(int i = 0; i < sql->num_binds; ++i)
+            sqlite3_bind_text(stmt, i + 1, sql->binds[i], -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, sql->num_binds + 1, limit > 0 ? limit : -1);
+    }
+    for(int i = 0; i < sql->num_binds; ++i)
+        free(sql->binds[i]);
+    return stmt;
+}
+
+int
+fb2_index_search(FB2Index *index, const FB2IndexQuery *query,
+                 FB2IndexBookFunc func, void *user_data)
+{
+    assert(index);
+    assert(query);
+    Fb2Sql sql;
+    memset(&sql, 0, sizeof(Fb2Sql));
+    sql_append(&sql, "SELECT ");
+    sql_append(&sql, fb2_index_columns);
+    sql_append(&sql, " FROM books");
+    sql_filters(&sql, query);
+    sql_append(&sql, " ORDER BY books.author_key, books.sequence_key, books.sequence_number,"
+                     " books.title_key");
+    sqlite3_stmt *stmt = sql_prepare(index, &sql, query->limit);
+    if(stmt == NULL)
+        return -1;
+
+    int count = 0;
+    int rc;
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        FB2IndexBook book;
+        book.path = column_text(stmt, 0);
+        book.size = sqlite3_column_int64(stmt, 1);
+        book.mtime = sqlite3_column_int64(stmt, 2);
+        book.title = column_text(stmt, 3);
+        book.first_name = column_text(stmt, 4);
+        book.middle_name = column_text(stmt, 5);
+        book.last_name = column_text(stmt, 6);
+        book.author = column_text(stmt, 7);
+        book.sequence_name = column_text(stmt, 8);
+        book.sequence_number = column_text(stmt, 9);
+        book.genres = column_text(stmt, 10);
+        func(&book, user_data);
+        ++count;
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
+
+int
+fb2_index_facets(FB2Index *index, const FB2IndexQuery *query,
+                 enum FB2_INDEX_FACET facet,
+                 FB2IndexFacetFunc func, void *user_data)
+{
+    assert(index);
+    assert(query);
+    Fb2Sql sql;
+    memset(&sql, 0, sizeof(Fb2Sql));
+    if(query->words == NULL && query->author == NULL && query->title == NULL &&
+       query->sequence == NULL && query->genre == NULL) {
+        static const char *counts[] = { "author_counts", "sequence_counts", "genre_counts" };
+        if(facet < FB2_INDEX_FACET_AUTHOR || facet > FB2_INDEX_FACET_GENRE)
+            return -1;
+        sql_append(&sql, "SELECT name, count FROM ");
+        sql_append(&sql, counts[facet]);
+    } else {
+        switch(facet) {
+        case FB2_INDEX_FACET_AUTHOR:
+            sql_append(&sql, "SELECT min(books.author), count(*) FROM books");
+            sql_filters(&sql, query);
+            sql_append(&sql, " AND books.author_key IS NOT NULL GROUP BY books.author_key");
+            break;
+        case FB2_INDEX_FACET_SEQUENCE:
+            sql_append(&sql, "SELECT min(books.sequence), count(*) FROM books");
+            sql_filters(&sql, query);
+            sql_append(&sql, " AND books.sequence_key IS NOT NULL GROUP BY books.sequence_key");
+            break;
+        case FB2_INDEX_FACET_GENRE:
+            sql_append(&sql, "SELECT g.genre, count(*) FROM book_genres AS g"
+                             " JOIN books ON books.id = g.book_id");
+            sql_filters(&sql, query);
+            sql_append(&sql, " GROUP BY g.genre");
+            break;
+        default:
+            return -1;
+        }
+    }
+    sql_append(&sql, " ORDER BY 2 DESC, 1");
+    sqlite3_stmt *stmt = sql_prepare(index, &sql, query->limit);
+    if(stmt == NULL)
+        return -1;
+
+    int count = 0;
+    int rc;
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        func(column_text(stmt, 0), sqlite3_column_int(stmt, 1), user_data);
+        ++count;
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
@@ -0,0 +1,114 @@
+#ifndef FB2_INDEX_H
+#define FB2_INDEX_H
+
+/* Persistent search index over extracted FB2 metadata (SQLite + FTS5).
+ *
+ * The extension adds every book it parses, fb2-query --scan adds the books
+ * of a folder, fb2-query searches the index. Only SQLite and GLib (for
+ * Unicode case folding) are used here, the parser is in fb2-parse.h. */
+
+#include <stdint.h>
+
+typedef struct _FB2Index FB2Index;
+
+/* Schema version, indexes written by another one can't be read */
+#define FB2_INDEX_VERSION 3
+
+enum FB2_INDEX_MODE {
+    FB2_INDEX_READ_ONLY = 0,     /* Queries only, never changes the file */
+    FB2_INDEX_READ_WRITE,        /* Creates a new index, keeps any other */
+    FB2_INDEX_MIGRATE            /* Also replaces an index of another version */
+};
+
+/* One book. Strings may be NULL. */
+typedef struct
+{
+    const char *path;
+    int64_t size;
+    int64_t mtime;               /* Nanoseconds */
+    const char *title;
+    const char *first_name;
+    const char *middle_name;
+    const char *last_name;
+    const char *author;          /* "Last First Middle", filled by the index */
+    const char *sequence_name;
+    const char *sequence_number;
+    const char *genres;          /* Space separated */
+} FB2IndexBook;
+
+/* Search. Facets match by case-insensitive prefix in any script, words are
+   prefix matched against title, author, sequence and genres. */
+typedef struct
+{
+    const char *words;
+    const char *author;
+    const char *title;
+    const char *sequence;
+    const char *genre;           /* Exact genre code, e.g. "sf_history" */
+    int limit;
+} FB2IndexQuery;
+
+enum FB2_INDEX_FACET {
+    FB2_INDEX_FACET_AUTHOR = 0,
+    FB2_INDEX_FACET_SEQUENCE,
+    FB2_INDEX_FACET_GENRE
+};
+
+/* Negative cache entry: a file that is not FB2, or is broken.
+   It stays valid while device, inode, size and mtime are unchanged. */
+typedef struct
+{
+    int64_t device;
+    int64_t inode;
+    int64_t size;
+    int64_t mtime;               /* Nanoseconds */
+    const char *path;            /* Where it was seen, for pruning */
+    const char *reason;
+} FB2IndexReject;
+
+typedef void (*FB2IndexBookFunc) (const FB2IndexBook *book, void *user_data);
+typedef void (*FB2IndexFacetFunc) (const char *value, int count, void *user_data);
+typedef void (*FB2IndexRejectFunc) (const FB2IndexReject *reject, void *user_data);
+
+/* Default location: $XDG_CACHE_HOME/fb2-extension/index.db, or
+   $FB2_EXTENSION_INDEX when set. Returns a malloc'ed string or NULL. */
+char *fb2_index_default_path(void);
+
+/* Returns NULL on error. version, if not NULL, is set to the version found
+   in the file, which tells a version mismatch from other errors. */
+FB2Index *fb2_index_open(const char *path, enum FB2_INDEX_MODE mode, int *version);
+void fb2_index_close(FB2Index *index);
+const char *fb2_index_error(FB2Index *index);
+
+/* Adds or replaces a book. Writes are batched in a transaction which is
+   committed by fb2_index_flush() (and fb2_index_close()). */
+int fb2_index_put(FB2Index *index, const FB2IndexBook *book);
+int fb2_index_flush(FB2Index *index);
+
+/* Drops a book, e.g. one that no longer parses. Batched like fb2_index_put(). */
+int fb2_index_remove(FB2Index *index, const char *path);
+/* Drops books whose files are gone and commits.
+   Returns the number removed, or -1 on error. */
+int fb2_index_prune(FB2Index *index);
+
+/* Negative cache, batched like fb2_index_put(). */
+int fb2_index_reject(FB2Index *index, const FB2IndexReject *reject);
+int fb2_index_unreject(FB2Index *index, int64_t device, int64_t inode);
+/* Reports at most limit (if > 0) entries, most recently written first */
+int fb2_index_rejects(FB2Index *index, int limit, FB2IndexRejectFunc func, void *user_data);
+/* 1 if path is indexed, or the file is rejected, with this size and mtime:
+   it need not be read again. 0 if not, -1 on error. */
+int fb2_index_is_current(FB2Index *index, const char *path, int64_t device, int64_t inode,
+                         int64_t size, int64_t mtime);
+/* Drops entries whose path is gone or now is another file, and commits.
+   Returns the number removed, or -1 on error. */
+int fb2_index_prune_rejects(FB2Index *index);
+
+/* Both return the number of rows reported, or -1 on error. */
+int fb2_index_search(FB2Index *index, const FB2IndexQuery *query,
+                     FB2IndexBookFunc func, void *user_data);
+int fb2_index_facets(FB2Index *index, const FB2IndexQuery *query,
+                     enum FB2_INDEX_FACET facet,
+                     FB2IndexFacetFunc func, void *user_data);
+
+#endif /* FB2_INDEX_H */
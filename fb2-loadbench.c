@@ -0,0 +1,623 @@
+/* Headless load harness for fb2-extension.so.
+ *
+ * Loads the extension the same way Nautilus does (nautilus_module_initialize,
+ * nautilus_module_list_types), creates the info provider and fires
+ * update_file_info for a directory of synthetic books, using a stand-in
+ * NautilusFileInfo and its own GMainLoop.
+ *
+ * Reports:
+ *   - the longest main loop iteration (time between two polls), which is
+ *     what the user sees as a UI stall;
+ *   - completion latency percentiles, from update_file_info to the
+ *     update_complete closure (or to the synchronous return);
+ *   - peak resident memory of the process.
+ *
+ * Usage: fb2-loadbench [-n files] [-z zip%] [-x broken%] [-m misnamed%]
+ *                      [-s body KiB] [-b batch] [-d dir] [-k]
+ *                      [path/to/fb2-extension.so]
+ *
+ * Misnamed books are plain FB2 saved as .bin with an application/octet-stream
+ * MIME type, which the extension has to recognise by content.
+ *
+ * Books are written to a temporary directory which is removed afterwards
+ * unless -k is given; a directory passed with -d is always kept.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <zip.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gmodule.h>
+#include <nautilus-extension.h>
+
+/* Stand-in NautilusFileInfo */
+typedef struct {
+    GObject parent_slot;
+    GFile *location;
+    char *name;
+    char *mime_type;
+    GHashTable *attributes;
+} BenchFileInfo;
+
+typedef struct {
+    GObjectClass parent_slot;
+} BenchFileInfoClass;
+
+static void bench_file_info_iface_init (NautilusFileInfoIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BenchFileInfo, bench_file_info, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (NAUTILUS_TYPE_FILE_INFO,
+                                                bench_file_info_iface_init))
+
+static void
+bench_file_info_finalize (GObject *object)
+{
+    BenchFileInfo *file = (BenchFileInfo*)object;
+    g_object_unref (file->location);
+    g_free (file->name);
+    g_free (file->mime_type);
+    g_hash_table_destroy (file->attributes);
+    G_OBJECT_CLASS (bench_file_info_parent_class)->finalize (object);
+}
+
+static void
+bench_file_info_class_init (BenchFileInfoClass *class)
+{
+    G_OBJECT_CLASS (class)->finalize = bench_file_info_finalize;
+}
+
+static void
+bench_file_info_init (BenchFileInfo *file)
+{
+    file->attributes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+}
+
+static gboolean
+bench_file_info_is_gone (NautilusFileInfo *file)
+{
+    return FALSE;
+}
+
+static char *
+bench_file_info_get_name (NautilusFileInfo *file)
+{
+    return g_strdup (((BenchFileInfo*)file)->name);
+}
+
+static char *
+bench_file_info_get_uri (NautilusFileInfo *file)
+{
+    return g_file_get_uri (((BenchFileInfo*)file)->location);
+}
+
+static char *
+bench_file_info_get_mime_type (NautilusFileInfo *file)
+{
+    return g_strdup (((BenchFileInfo*)file)->mime_type);
+}
+
+static gboolean
+bench_file_info_is_mime_type (NautilusFileInfo *file, const char *mime_type)
+{
+    return g_strcmp0 (((BenchFileInfo*)file)->mime_type, mime_type) == 0;
+}
+
+static gboolean
+bench_file_info_is_directory (NautilusFileInfo *file)
+{
+    return FALSE;
+}
+
+static char *
+bench_file_info_get_string_attribute (NautilusFileInfo *file,
+                                      const char *attribute_name)
+{
+    return g_strdup (g_hash_table_lookup (((BenchFileInfo*)file)->attributes,
+                                          attribute_name));
+}
+
+static void
+bench_file_info_add_string_attribute (NautilusFileInfo *file,
+                                      const char *attribute_name,
+                                      const char *value)
+{
+    g_hash_table_replace (((BenchFileInfo*)file)->attributes,
+                          g_strdup (attribute_name), g_strdup (value));
+}
+
+static GFile *
+bench_file_info_get_location (NautilusFileInfo *file)
+{
+    return g_object_ref (((BenchFileInfo*)file)->location);
+}
+
+static void
+bench_file_info_iface_init (NautilusFileInfoIface *iface)
+{
+    iface->is_gone = bench_file_info_is_gone;
+    iface->get_name = bench_file_info_get_name;
+    iface->get_uri = bench_file_info_get_uri;
+    iface->get_mime_type = bench_file_info_get_mime_type;
+    iface->is_mime_type = bench_file_info_is_mime_type;
+    iface->is_directory = bench_file_info_is_directory;
+    iface->get_string_attribute = bench_file_info_get_string_attribute;
+    iface->add_string_attribute = bench_file_info_add_string_attribute;
+    iface->get_location = bench_file_info_get_location;
+}
+
+/* GTypeModule that loads the extension like NautilusModule does */
+typedef struct {
+    GTypeModule parent_slot;
+    char *path;
+    GModule *library;
+    void (*initialize) (GTypeModule *module);
+    void (*shutdown) (void);
+    void (*list_types) (const GType **types, int *num_types);
+} BenchModule;
+
+typedef struct {
+    GTypeModuleClass parent_slot;
+} BenchModuleClass;
+
+G_DEFINE_TYPE (BenchModule, bench_module, G_TYPE_TYPE_MODULE)
+
+static gboolean
+bench_module_load (GTypeModule *gmodule)
+{
+    BenchModule *module = (BenchModule*)gmodule;
+    module->library = g_module_open (module->path, G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+    if (!module->library) {
+        fprintf (stderr, "%s\n", g_module_error ());
+        return FALSE;
+    }
+    if (!g_module_symbol (module->library, "nautilus_module_initialize",
+                          (gpointer*)&module->initialize) ||
+        !g_module_symbol (module->library, "nautilus_module_shutdown",
+                          (gpointer*)&module->shutdown) ||
+        !g_module_symbol (module->library, "nautilus_module_list_types",
+                          (gpointer*)&module->list_types)) {
+        fprintf (stderr, "%s\n", g_module_error ());
+        g_module_close (module->library);
+        module->library = NULL;
+        return FALSE;
+    }
+    module->initialize (gmodule);
+    return TRUE;
+}
+
+static void
+bench_module_unload (GTypeModule *gmodule)
+{
+    BenchModule *module = (BenchModule*)gmodule;
+    module->shutdown ();
+    g_module_close (module->library);
+    module->library = NULL;
+}
+
+static void
+bench_module_class_init (BenchModuleClass *class)
+{
+    G_TYPE_MODULE_CLASS (class)->load = bench_module_load;
+    G_TYPE_MODULE_CLASS (class)->unload = bench_module_unload;
+}
+
+static void
+bench_module_init (BenchModule *module)
+{
+}
+
+/* Synthetic books */
+enum BENCH_KIND {
+    BENCH_KIND_PLAIN = 0,
+    BENCH_KIND_ZIP,
+    BENCH_KIND_BROKEN,
+    BENCH_KIND_MISNAMED
+};
+
+static const char fb2_head[] =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+    "<FictionBook xmlns=\"http://www.gribuser.ru/xml/fictionbook/2.0\">\n"
+    "<description><title-info>\n"
+    "<genre>sf</genre>\n"
+    "<author><first-name>Bench</first-name><last-name>Author %d</last-name></author>\n"
+    "<book-title>Synthetic book %d</book-title>\n"
+    "<sequence name=\"Load series %d\" number=\"%d\"/>\n"
+    "</title-info></description>\n"
+    "<body><section>\n";
+static const char fb2_paragraph[] =
+    "<p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+    "tempor incididunt ut labore et dolore magna aliqua.</p>\n";
+static const char fb2_tail[] = "</section></body>\n</FictionBook>\n";
+
+static GString *
+bench_make_book (int n, size_t body_size, gboolean broken)
+{
+    GString *book = g_string_sized_new (body_size + sizeof(fb2_head) + 64);
+    g_string_append_printf (book, fb2_head, n % 997, n, n % 101, n % 50);
+    while (book->len < body_size)
+        g_string_append (book, fb2_paragraph);
+    if (broken) {
+        /* Cut inside the description so no reader can recover the title */
+        const char *cut = strstr (book->str, "</book-title>");
+        g_string_truncate (book, cut - book->str);
+    } else {
+        g_string_append (book, fb2_tail);
+    }
+    return book;
+}
+
+static gboolean
+bench_write_zip (const char *path, GString *book)
+{
+    int err = 0;
+    struct zip *za = zip_open (path, ZIP_CREATE | ZIP_TRUNCATE, &err);
+    if (za == NULL)
+        return FALSE;
+    /* libzip reads the buffer on zip_close, keep it alive until then */
+    struct zip_source *source = zip_source_buffer (za, book->str, book->len, 0);
+    if (source == NULL || zip_file_add (za, "book.fb2", source, ZIP_FL_OVERWRITE) < 0) {
+        zip_source_free (source);
+        zip_discard (za);
+        return FALSE;
+    }
+    return zip_close (za) == 0;
+}
+
+static BenchFileInfo *
+bench_create_file (const char *dir, int n, enum BENCH_KIND kind, size_t body_size)
+{
+    BenchFileInfo *file = g_object_new (bench_file_info_get_type (), NULL);
+    GString *book = bench_make_book (n, body_size, kind == BENCH_KIND_BROKEN);
+    gboolean written;
+    if (kind == BENCH_KIND_ZIP) {
+        file->name = g_strdup_printf ("book-%06d.fb2.zip", n);
+        file->mime_type = g_strdup ("application/x-zip-compressed-fb2");
+    } else if (kind == BENCH_KIND_MISNAMED) {
+        file->name = g_strdup_printf ("book-%06d.bin", n);
+        file->mime_type = g_strdup ("application/octet-stream");
+    } else {
+        file->name = g_strdup_printf ("book-%06d.fb2", n);
+        file->mime_type = g_strdup ("application/x-fictionbook+xml");
+    }
+    char *path = g_build_filename (dir, file->name, NULL);
+    if (kind == BENCH_KIND_ZIP)
+        written = bench_write_zip (path, book);
+    else
+        written = g_file_set_contents (path, book->str, book->len, NULL);
+    if (!written) {
+        fprintf (stderr, "Can't write %s\n", path);
+        exit (EXIT_FAILURE);
+    }
+    file->location = g_file_new_for_path (path);
+    g_free (path);
+    g_string_free (book, TRUE);
+    return file;
+}
+
+/* Checks the columns the extension filled in against what was written */
+static gboolean
+bench_check (int n, enum BENCH_KIND kind, BenchFileInfo *file)
+{
+    const char *title = g_hash_table_lookup (file->attributes,
+                                             "FB2Extension::fb2_title");
+    const char *last_name = g_hash_table_lookup (file->attributes,
+                                                 "FB2Extension::fb2_lastname");
+    gboolean ok;
+    if (kind == BENCH_KIND_BROKEN) {
+        ok = title != NULL && last_name == NULL &&
+             g_str_has_prefix (title, "Invalid FB2 file.");
+    } else {
+        char *expected_title = g_strdup_printf ("Synthetic book %d", n);
+        char *expected_last_name = g_strdup_printf ("Author %d", n % 997);
+        ok = g_strcmp0 (title, expected_title) == 0 &&
+             g_strcmp0 (last_name, expected_last_name) == 0;
+        g_free (expected_title);
+        g_free (expected_last_name);
+    }
+    return ok;
+}
+
+/* Load run */
+typedef struct {
+    BenchFileInfo *file;
+    enum BENCH_KIND kind;
+    gint64 submitted;
+    gint64 completed;
+} BenchRequest;
+
+typedef struct {
+    GMainLoop *loop;
+    NautilusInfoProvider *provider;
+    BenchRequest *requests;
+    int num_requests;
+    int next_request;
+    int batch;
+    int num_completed;
+    int num_in_progress;
+} BenchRun;
+
+static GPollFunc default_poll;
+static gint64 last_poll_return;
+static gint64 longest_iteration;
+static guint64 num_iterations;
+static guint64 num_iterations_over[3];
+static const gint64 iteration_limits[3] = { 4000, 16000, 50000 };
+
+/* Everything between two polls is one main loop iteration, i.e. the time
+   Nautilus could not redraw or react to input. */
+static gint
+bench_poll (GPollFD *ufds, guint nfds, gint timeout)
+{
+    gint64 now = g_get_monotonic_time ();
+    if (last_poll_return) {
+        const gint64 iteration = now - last_poll_return;
+        if (iteration > longest_iteration)
+            longest_iteration = iteration;
+        for (int i = 0; i < G_N_ELEMENTS (iteration_limits); ++i)
+            if (iteration > iteration_limits[i])
+                ++num_iterations_over[i];
+        ++num_iterations;
+    }
+    gint ret = default_poll (ufds, nfds, timeout);
+    last_poll_return = g_get_monotonic_time ();
+    return ret;
+}
+
+static void
+bench_complete (BenchRun *run, BenchRequest *request)
+{
+    request->completed = g_get_monotonic_time ();
+    if (++run->num_completed == run->num_requests)
+        g_main_loop_quit (run->loop);
+}
+
+static BenchRun *bench_run;
+
+static void
+bench_update_complete (NautilusInfoProvider *provider,
+                       NautilusOperationHandle *handle,
+                       NautilusOperationResult result,
+                       gpointer user_data)
+{
+    --bench_run->num_in_progress;
+    bench_complete (bench_run, (BenchRequest*)user_data);
+}
+
+/* Nautilus asks for file info in bursts as the view is populated */
+static gboolean
+bench_submit_batch (gpointer data)
+{
+    BenchRun *run = (BenchRun*)data;
+    for (int i = 0; i < run->batch && run->next_request < run->num_requests; ++i) {
+        BenchRequest *request = &run->requests[run->next_request++];
+        NautilusOperationHandle *handle = NULL;
+        GClosure *closure = g_cclosure_new (G_CALLBACK (bench_update_complete),
+                                            request, NULL);
+        g_closure_ref (closure);
+        g_closure_sink (closure);
+        g_closure_set_marshal (closure, g_cclosure_marshal_generic);
+        request->submitted = g_get_monotonic_time ();
+        NautilusOperationResult result =
+            nautilus_info_provider_update_file_info (run->provider,
+                                                     NAUTILUS_FILE_INFO (request->file),
+                                                     closure, &handle);
+        if (result == NAUTILUS_OPERATION_IN_PROGRESS)
+            ++run->num_in_progress;
+        else
+            bench_complete (run, request);
+        g_closure_unref (closure);
+    }
+    return run->next_request < run->num_requests;
+}
+
+static int
+bench_compare_gint64 (const void *a, const void *b)
+{
+    const gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static gint64
+bench_percentile (const gint64 *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void
+bench_remove_dir (const char *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const char *name;
+    if (d == NULL)
+        return;
+    while ((name = g_dir_read_name (d)) != NULL) {
+        char *path = g_build_filename (dir, name, NULL);
+        g_unlink (path);
+        g_free (path);
+    }
+    g_dir_close (d);
+    g_rmdir (dir);
+}
+
+static void
+usage (const char *argv0)
+{
+    fprintf (stderr,
+             "Usage: %s [-n files] [-z zip%%] [-x broken%%] [-m misnamed%%]\n"
+             "          [-s body KiB] [-b batch] [-d dir] [-k]\n"
+             "          [path/to/fb2-extension.so]\n",
+             argv0);
+    exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+    int num_files = 20000;
+    int zip_percent = 30;
+    int broken_percent = 5;
+    int misnamed_percent = 5;
+    int body_kib = 4;
+    int batch = 100;
+    const char *dir_arg = NULL;
+    gboolean keep = FALSE;
+    const char *extension = "./fb2-extension.so";
+    int opt;
+
+    while ((opt = getopt (argc, argv, "n:z:x:m:s:b:d:k")) != -1) {
+        switch (opt) {
+        case 'n': num_files = atoi (optarg); break;
+        case 'z': zip_percent = atoi (optarg); break;
+        case 'x': broken_percent = atoi (optarg); break;
+        case 'm': misnamed_percent = atoi (optarg); break;
+        case 's': body_kib = atoi (optarg); break;
+        case 'b': batch = atoi (optarg); break;
+        case 'd': dir_arg = optarg; break;
+        case 'k': keep = TRUE; break;
+        default: usage (argv[0]);
+        }
+    }
+    if (optind < argc)
+        extension = argv[optind];
+    if (num_files <= 0 || batch <= 0 || body_kib < 0)
+        usage (argv[0]);
+
+    /* Load the extension */
+    BenchModule *module = g_object_new (bench_module_get_type (), NULL);
+    module->path = g_strdup (extension);
+    g_type_module_set_name (G_TYPE_MODULE (module), extension);
+    if (!g_type_module_use (G_TYPE_MODULE (module))) {
+        fprintf (stderr, "Can't load %s\n", extension);
+        return EXIT_FAILURE;
+    }
+    const GType *types;
+    int num_types;
+    GObject *provider = NULL;
+    module->list_types (&types, &num_types);
+    for (int i = 0; i < num_types; ++i) {
+        if (g_type_is_a (types[i], NAUTILUS_TYPE_INFO_PROVIDER)) {
+            provider = g_object_new (types[i], NULL);
+            break;
+        }
+    }
+    if (provider == NULL) {
+        fprintf (stderr, "%s has no NautilusInfoProvider\n", extension);
+        return EXIT_FAILURE;
+    }
+
+    /* Generate books */
+    char *dir;
+    if (dir_arg) {
+        /* Never wipe a directory we did not create */
+        dir = g_strdup (dir_arg);
+        g_mkdir_with_parents (dir, 0700);
+        keep = TRUE;
+    } else {
+        dir = g_dir_make_tmp ("fb2-loadbench-XXXXXX", NULL);
+    }
+    if (dir == NULL) {
+        fprintf (stderr, "Can't create working directory\n");
+        return EXIT_FAILURE;
+    }
+    /* Keep the extension's search index out of the user's cache */
+    char *index_path = g_build_filename (dir, "index.db", NULL);
+    g_setenv ("FB2_EXTENSION_INDEX", index_path, FALSE);
+    g_free (index_path);
+    fprintf (stderr, "Writing %d books to %s\n", num_files, dir);
+    BenchRun run = { 0 };
+    run.requests = g_new0 (BenchRequest, num_files);
+    run.num_requests = num_files;
+    run.batch = batch;
+    run.provider = NAUTILUS_INFO_PROVIDER (provider);
+    for (int i = 0; i < num_files; ++i) {
+        const int roll = (int)((i * 7919u) % 100);
+        enum BENCH_KIND kind = BENCH_KIND_PLAIN;
+        if (roll < broken_percent)
+            kind = BENCH_KIND_BROKEN;
+        else if (roll < broken_percent + zip_percent)
+            kind = BENCH_KIND_ZIP;
+        else if (roll < broken_percent + zip_percent + misnamed_percent)
+            kind = BENCH_KIND_MISNAMED;
+        run.requests[i].kind = kind;
+        run.requests[i].file = bench_create_file (dir, i, kind,
+                                                  (size_t)body_kib * 1024);
+    }
+
+    /* Drive update_file_info from our own main loop */
+    GMainContext *context = g_main_context_default ();
+    default_poll = g_main_context_get_poll_func (context);
+    g_main_context_set_poll_func (context, bench_poll);
+    run.loop = g_main_loop_new (context, FALSE);
+    bench_run = &run;
+    const gint64 start = g_get_monotonic_time ();
+    g_idle_add (bench_submit_batch, &run);
+    g_main_loop_run (run.loop);
+    const gint64 elapsed = g_get_monotonic_time () - start;
+    g_main_context_set_poll_func (context, default_poll);
+
+    /* Report */
+    gint64 *latency = g_new (gint64, num_files);
+    int num_ok = 0, num_failed = 0, num_empty = 0, num_wrong = 0;
+    for (int i = 0; i < num_files; ++i) {
+        BenchFileInfo *file = run.requests[i].file;
+        const char *title = g_hash_table_lookup (file->attributes,
+                                                 "FB2Extension::fb2_title");
+        const char *last_name = g_hash_table_lookup (file->attributes,
+                                                     "FB2Extension::fb2_lastname");
+        latency[i] = run.requests[i].completed - run.requests[i].submitted;
+        if (title == NULL)
+            ++num_empty;
+        else if (last_name != NULL)
+            ++num_ok;
+        else
+            ++num_failed;
+        if (!bench_check (i, run.requests[i].kind, file)) {
+            if (num_wrong < 10)
+                fprintf (stderr, "%s: unexpected title '%s', last name '%s'\n",
+                         file->name, title ? title : "(none)",
+                         last_name ? last_name : "(none)");
+            ++num_wrong;
+        }
+    }
+    qsort (latency, num_files, sizeof(gint64), bench_compare_gint64);
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+
+    printf ("files:               %d (ok %d, error %d, no info %d, wrong %d)\n",
+            num_files, num_ok, num_failed, num_empty, num_wrong);
+    printf ("wall time:           %.1f ms (%.0f files/s)\n",
+            elapsed / 1000.0, num_files / (elapsed / 1e6));
+    printf ("loop iterations:     %" G_GUINT64_FORMAT
+            " (>4 ms: %" G_GUINT64_FORMAT ", >16 ms: %" G_GUINT64_FORMAT
+            ", >50 ms: %" G_GUINT64_FORMAT ")\n",
+            num_iterations, num_iterations_over[0], num_iterations_over[1],
+            num_iterations_over[2]);
+    printf ("longest stall:       %.3f ms\n", longest_iteration / 1000.0);
+    printf ("latency p50/p90/p99: %.3f / %.3f / %.3f ms\n",
+            bench_percentile (latency, num_files, 50) / 1000.0,
+            bench_percentile (latency, num_files, 90) / 1000.0,
+            bench_percentile (latency, num_files, 99) / 1000.0);
+    printf ("latency max:         %.3f ms\n", latency[num_files - 1] / 1000.0);
+    printf ("peak RSS:            %ld KiB\n", usage.ru_maxrss);
+
+    /* Cleanup */
+    for (int i = 0; i < num_files; ++i)
+        g_object_unref (run.requests[i].file);
+    g_free (run.requests);
+    g_free (latency);
+    g_main_loop_unref (run.loop);
+    g_object_unref (provider);
+    module->shutdown ();
+    if (!keep)
+        bench_remove_dir (dir);
+    g_free (dir);
+    return num_wrong == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
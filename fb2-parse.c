@@ -0,0 +1,568 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libxml/tree.h>
+#include <libxml/parser.h>
+#include <libxml/SAX2.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+
+#include <zip.h>
+#include <zlib.h>
+#include <glib.h>
+
+#include "fb2-parse.h"
+
+const static char nonFb2[] = "Non FB2 file.";
+const char *fb2_errors[] = {"ok", "Invalid FB2 file.", "can't open zip archive",
+                            "ZIP read error", "ZIP inner file read error",
+                            "can't close zip archive", "Error: unable to parse file from memory buffer",
+                            "Error: unable to create new XPath context",
+                            nonFb2, "Unsupported compression", "read error"};
+
+/* Content sniffing */
+#define FB2_SNIFF_SIZE 64
+
+enum FB2_FORMAT {
+    FB2_FORMAT_UNREADABLE = -1,
+    FB2_FORMAT_UNKNOWN = 0,
+    FB2_FORMAT_XML,
+    FB2_FORMAT_ZIP,
+    FB2_FORMAT_GZIP,
+    FB2_FORMAT_BZIP2,
+    FB2_FORMAT_XZ
+};
+
+/* Resumable parsing */
+#define FB2_PARSER_CHUNK_SIZE 16384
+
+typedef enum {
+    FB2_PARSER_OPEN = 0,
+    FB2_PARSER_READ,
+    FB2_PARSER_DONE
+} FB2ParserState;
+
+struct _FB2Parser {
+    char *filename;
+    gboolean named;
+    gboolean zipped;
+    FB2ParserState state;
+    gboolean description_done;
+    gboolean not_fb2; /* Root element isn't <FictionBook> */
+    gzFile plain; /* Also reads gzip'ed books */
+    struct zip *archive;
+    struct zip_file *entry;
+    zip_uint64_t entry_size;
+    zip_uint64_t bytes_read;
+    xmlParserCtxtPtr ctxt;
+    FB2Info info;
+    int result;
+};
+
+static xmlSAXHandler fb2_parser_sax;
+
+static int process_xml(xmlDocPtr doc, FB2Info *info);
+
+char *
+fb2_error_message(int result)
+{
+    if(result == FB2_RESULT_NOT_FB2)
+        return g_strdup(nonFb2);
+    return g_strdup_printf("%s, Code: %d", fb2_errors[result], result);
+}
+
+/* Only those are remembered, I/O errors get another try next time */
+gboolean
+fb2_is_final_error(int result)
+{
+    return result == FB2_RESULT_NOT_FB2 || result == FB2_RESULT_INVALID_FB2 ||
+           result == FB2_RESULT_UNSUPPORTED;
+}
+
+gboolean
+fb2_is_book_name(const char *name)
+{
+    return name != NULL && (g_str_has_suffix(name, ".fb2") ||
+                            g_str_has_suffix(name, ".fb2.zip") ||
+                            g_str_has_suffix(name, ".fb2.gz"));
+}
+
+/* Content sniffing.
+   The first bytes decide which reader gets the file, names and MIME types
+   only decide whether to look at all. */
+static int
+fb2_sniff(const char *filename)
+{
+    unsigned char head[FB2_SNIFF_SIZE];
+    FILE *f = fopen(filename, "rb");
+    if(f == NULL)
+        return FB2_FORMAT_UNREADABLE;
+    size_t len = fread(head, 1, sizeof(head), f);
+    fclose(f);
+
+    if(len >= 4 && memcmp(head, "PK\x03\x04", 4) == 0)
+        return FB2_FORMAT_ZIP;
+    if(len >= 4 && memcmp(head, "PK\x05\x06", 4) == 0)
+        return FB2_FORMAT_ZIP; /* Empty archive */
+    if(len >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+        return FB2_FORMAT_GZIP;
+    if(len >= 3 && memcmp(head, "BZh", 3) == 0)
+        return FB2_FORMAT_BZIP2;
+    if(len >= 6 && memcmp(head, "\xfd" "7zXZ\0", 6) == 0)
+        return FB2_FORMAT_XZ;
+    if(len >= 2 && ((head[0] == 0xff && head[1] == 0xfe) ||
+                    (head[0] == 0xfe && head[1] == 0xff)))
+        return FB2_FORMAT_XML; /* UTF-16 BOM */
+
+    size_t i = 0;
+    if(len >= 3 && head[0] == 0xef && head[1] == 0xbb && head[2] == 0xbf)
+        i = 3; /* UTF-8 BOM */
+    while(i < len && (head[i] == ' ' || head[i] == '\t' || head[i] == '\r' || head[i] == '\n'))
+        ++i;
+    if(i < len && head[i] == '<')
+        return FB2_FORMAT_XML;
+    return FB2_FORMAT_UNKNOWN;
+}
+
+/* Picks the reader, FB2_RESULT_OK if there is one */
+static int
+fb2_sniff_result(const char *filename, gboolean *zipped)
+{
+    *zipped = FALSE;
+    switch(fb2_sniff(filename)) {
+    case FB2_FORMAT_UNREADABLE:
+        return FB2_RESULT_READ_ERR;
+    case FB2_FORMAT_XML:
+    case FB2_FORMAT_GZIP:
+        /* libxml2 and zlib read gzip'ed books transparently */
+        return FB2_RESULT_OK;
+    case FB2_FORMAT_ZIP:
+        *zipped = TRUE;
+        return FB2_RESULT_OK;
+    case FB2_FORMAT_BZIP2:
+    case FB2_FORMAT_XZ:
+        return FB2_RESULT_UNSUPPORTED;
+    default:
+        return FB2_RESULT_NOT_FB2;
+    }
+}
+
+static void
+fb2_parser_open(FB2Parser *parser)
+{
+    const char *filename = parser->filename;
+    parser->result = fb2_sniff_result(filename, &parser->zipped);
+    if(parser->result != FB2_RESULT_OK) {
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    parser->ctxt = xmlCreatePushParserCtxt(&fb2_parser_sax, NULL, NULL, 0, filename);
+    if(parser->ctxt == NULL) {
+        parser->result = parser->zipped ? FB2_RESULT_UNABLE_PARSE_MEM_BUFF : FB2_RESULT_INVALID_FB2;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    parser->ctxt->_private = parser;
+    if(!parser->zipped) {
+        /* Same behaviour as xmlParseFile */
+        parser->plain = gzopen(filename, "rb");
+        if(parser->plain == NULL) {
+            parser->result = FB2_RESULT_READ_ERR;
+            parser->state = FB2_PARSER_DONE;
+            return;
+        }
+        parser->state = FB2_PARSER_READ;
+        return;
+    }
+    /* Zipped books have always been read leniently */
+    xmlCtxtUseOptions(parser->ctxt, XML_PARSE_NOERROR | XML_PARSE_NOWARNING | XML_PARSE_RECOVER);
+
+    int err = 0;
+    struct zip_stat sb;
+    zip_int64_t num64;
+    zip_uint64_t i;
+    size_t len;
+    if ((parser->archive = zip_open(filename, 0, &err)) == NULL) {
+        /* A broken archive stays broken */
+        parser->result = (err == ZIP_ER_NOZIP || err == ZIP_ER_INCONS) ?
+                         FB2_RESULT_INVALID_FB2 : FB2_RESULT_CANT_OPEN;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    /* First .fb2 entry. An archive that is not called a book is one only
+       if that is its only .fb2, otherwise it is a collection. */
+    zip_int64_t book = -1;
+    num64 = zip_get_num_entries(parser->archive, 0);
+    for (i = 0; i < num64; ++i) {
+        zip_stat_init(&sb);
+        if (zip_stat_index(parser->archive, i, 0, &sb) != 0)
+            continue;
+        len = strlen(sb.name);
+        if(len > 4 && g_strcmp0(&sb.name[len-4], ".fb2") == 0) {
+            if(book >= 0) {
+                book = -1;
+                break;
+            }
+            book = (zip_int64_t)i;
+            parser->entry_size = sb.size;
+            if(parser->named)
+                break;
+        }
+    }
+    if(book < 0) {
+        /* No book inside, or many */
+        parser->result = FB2_RESULT_NOT_FB2;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    parser->entry = zip_fopen_index(parser->archive, (zip_uint64_t)book, 0);
+    if(!parser->entry) {
+        parser->result = FB2_RESULT_ZIP_OPEN_FILE_ERR;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    parser->state = FB2_PARSER_READ;
+}
+
+/* Only FictionBook documents are built. Any other XML (a database dump
+   that happens to be in the folder) is given up on at its first element,
+   and a book without <description> at its <body>. */
+static void
+fb2_parser_start_element(void *ctx, const xmlChar *localname,
+                         const xmlChar *prefix, const xmlChar *URI,
+                         int nb_namespaces, const xmlChar **namespaces,
+                         int nb_attributes, int nb_defaulted,
+                         const xmlChar **attributes)
+{
+    xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr)ctx;
+    FB2Parser *parser = (FB2Parser*)ctxt->_private;
+    xmlNodePtr root = ctxt->myDoc ? xmlDocGetRootElement(ctxt->myDoc) : NULL;
+    if(root == NULL && !xmlStrEqual(localname, (const xmlChar *)"FictionBook")) {
+        parser->not_fb2 = TRUE;
+        xmlStopParser(ctxt);
+        return;
+    }
+    if(root != NULL && ctxt->node == root &&
+       (xmlStrEqual(localname, (const xmlChar *)"body") ||
+        xmlStrEqual(localname, (const xmlChar *)"binary"))) {
+        parser->description_done = TRUE;
+        xmlStopParser(ctxt);
+        return;
+    }
+    xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces, namespaces,
+                          nb_attributes, nb_defaulted, attributes);
+}
+
+/* Everything FB2Info needs is in <description>, the body and the binary
+   covers after it can be megabytes. The document built so far holds the
+   complete description, so stop there and let process_xml look at that. */
+static void
+fb2_parser_end_element(void *ctx, const xmlChar *localname,
+                       const xmlChar *prefix, const xmlChar *URI)
+{
+    xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr)ctx;
+    xmlSAX2EndElementNs(ctx, localname, prefix, URI);
+    if(ctxt->myDoc != NULL &&
+       ctxt->node == xmlDocGetRootElement(ctxt->myDoc) &&
+       xmlStrEqual(localname, (const xmlChar *)"description")) {
+        ((FB2Parser*)ctxt->_private)->description_done = TRUE;
+        xmlStopParser(ctxt);
+    }
+}
+
+static void
+fb2_parser_read(FB2Parser *parser)
+{
+    char chunk[FB2_PARSER_CHUNK_SIZE];
+    zip_int64_t len;
+    if(parser->zipped) {
+        len = zip_fread(parser->entry, chunk, sizeof(chunk));
+    } else {
+        len = gzread(parser->plain, chunk, sizeof(chunk));
+    }
+    if(len < 0) {
+        parser->result = parser->zipped ? FB2_RESULT_ZIP_READ_FILE_ERR : FB2_RESULT_READ_ERR;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    parser->bytes_read += (zip_uint64_t)len;
+    if(len == 0 && parser->zipped && parser->bytes_read < parser->entry_size) {
+        parser->result = FB2_RESULT_ZIP_READ_FILE_ERR;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    xmlParseChunk(parser->ctxt, chunk, (int)len, len == 0);
+    if(parser->not_fb2) {
+        parser->result = FB2_RESULT_NOT_FB2;
+        parser->state = FB2_PARSER_DONE;
+        return;
+    }
+    if(!parser->description_done) {
+        if(!parser->zipped && !parser->ctxt->wellFormed) {
+            /* xmlParseFile would give up here too, don't read the rest */
+            parser->result = FB2_RESULT_INVALID_FB2;
+            parser->state = FB2_PARSER_DONE;
+            return;
+        }
+        if(len > 0)
+            return;
+    }
+
+    xmlDocPtr doc = parser->ctxt->myDoc;
+    parser->ctxt->myDoc = NULL;
+    if(doc == NULL)
+        parser->result = parser->zipped ? FB2_RESULT_UNABLE_PARSE_MEM_BUFF : FB2_RESULT_INVALID_FB2;
+    else
+        parser->result = process_xml(doc, &parser->info);
+    if(doc != NULL)
+        xmlFreeDoc(doc);
+    parser->state = FB2_PARSER_DONE;
+}
+
+
+/* Resumable parsing.
+   The file is fed to the libxml2 push parser one chunk at a time, so the
+   extension can spread a book over several idle ticks. Only the document
+   up to </description> is built, see the SAX hooks below. */
+FB2Parser *
+fb2_parser_new(const char *filename, gboolean named)
+{
+    static gsize sax_ready = 0;
+    if(g_once_init_enter(&sax_ready)) {
+        xmlSAXVersion(&fb2_parser_sax, 2);
+        fb2_parser_sax.startElementNs = fb2_parser_start_element;
+        fb2_parser_sax.endElementNs = fb2_parser_end_element;
+        g_once_init_leave(&sax_ready, 1);
+    }
+    FB2Parser *parser = g_new0(FB2Parser, 1);
+    parser->filename = g_strdup(filename);
+    parser->named = named;
+    return parser;
+}
+
+/* Files are closed as soon as the result is known, a folder of
+   thousands of books must not hold thousands of descriptors */
+static void
+fb2_parser_close(FB2Parser *parser)
+{
+    if(parser->plain != NULL) {
+        gzclose(parser->plain);
+        parser->plain = NULL;
+    }
+    if(parser->entry != NULL) {
+        zip_fclose(parser->entry);
+        parser->entry = NULL;
+    }
+    if(parser->archive != NULL) {
+        if(zip_close(parser->archive) == -1) {
+            zip_discard(parser->archive);
+            if(parser->result == FB2_RESULT_OK)
+                parser->result = FB2_RESULT_ZIP_CANT_CLOSE;
+        }
+        parser->archive = NULL;
+    }
+    if(parser->ctxt != NULL) {
+        if(parser->ctxt->myDoc != NULL)
+            xmlFreeDoc(parser->ctxt->myDoc);
+        xmlFreeParserCtxt(parser->ctxt);
+        parser->ctxt = NULL;
+    }
+}
+
+gboolean
+fb2_parser_step(FB2Parser *parser)
+{
+    assert(parser);
+    if(parser->state == FB2_PARSER_OPEN)
+        fb2_parser_open(parser);
+    else if(parser->state == FB2_PARSER_READ)
+        fb2_parser_read(parser);
+    if(parser->state != FB2_PARSER_DONE)
+        return FALSE;
+    fb2_parser_close(parser);
+    return TRUE;
+}
+
+int
+fb2_parser_result(FB2Parser *parser)
+{
+    return parser->result;
+}
+
+FB2Info *
+fb2_parser_info(FB2Parser *parser)
+{
+    return &parser->info;
+}
+
+void
+fb2_parser_free(FB2Parser *parser)
+{
+    if(parser == NULL)
+        return;
+    fb2_parser_close(parser);
+    clear_FB2Info(&parser->info);
+    g_free(parser->filename);
+    g_free(parser);
+}
+
+/* Fb2 */
+static xmlXPathObjectPtr
+getnodeset (xmlDocPtr doc, xmlXPathContextPtr context, const xmlChar *xpath)
+{
+    assert(doc);
+    assert(context);
+    assert(xpath);
+    xmlXPathObjectPtr result = NULL;
+    if (context == NULL)
+    {
+#ifdef DEBUG
+        fprintf(stderr, "Error in xmlXPathNewContext\n");
+#endif
+        return NULL;
+    }
+    result = xmlXPathEvalExpression(xpath, context);
+    if (result == NULL)
+    {
+#ifdef DEBUG
+        fprintf(stderr, "Error in xmlXPathEvalExpression\n");
+#endif
+        return NULL;
+    }
+    if(xmlXPathNodeSetIsEmpty(result->nodesetval) )
+    {
+        xmlXPathFreeObject(result);
+#ifdef DEBUG
+        fprintf(stderr, "No result\n");
+#endif
+        return NULL;
+    }
+    return result;
+}
+
+static int
+process_xml(xmlDocPtr doc, FB2Info *info)
+{
+    assert(doc);
+    assert(info);
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    if(root == NULL || xmlStrcmp(root->name, (const xmlChar *)"FictionBook") != 0)
+        return FB2_RESULT_NOT_FB2;
+
+    xmlXPathContextPtr xpathCtx;
+    xpathCtx = xmlXPathNewContext(doc);
+    if(xpathCtx == NULL)
+    {
+#ifdef DEBUG
+        fprintf(stderr, "Can't create XPATH context for XML document.\n");
+#endif
+        return FB2_RESULT_UNABLE_CREATE_XPATH_CONTEXT;
+    }
+
+    xmlXPathRegisterNs(xpathCtx, BAD_CAST "fb2", BAD_CAST "http://www.gribuser.ru/xml/fictionbook/2.0");
+
+    xmlNodeSetPtr nodeset;
+    xmlXPathObjectPtr result;
+    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:book-title");
+    if (result)
+    {
+        nodeset = result->nodesetval;
+        info->title = xmlNodeListGetString(doc, nodeset->nodeTab[0]->xmlChildrenNode, 1);
+#ifdef DEBUG
+        fprintf(stderr, "title: %s\n", info->title);
+#endif // DEBUG
+        xmlXPathFreeObject (result);
+    }
+    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:author");
+    if (result)
+    {
+        nodeset = result->nodesetval;
+#ifdef DEBUG
+        fprintf(stderr, "NUM OF AUTHORS: %d\n", nodeset->nodeNr);
+#endif // DEBUG
+        for (int i=0; i < nodeset->nodeNr; ++i)
+        {
+            xmlNodePtr author_node = nodeset->nodeTab[i];
+            xmlNode *cur_node = NULL;
+            for (cur_node = author_node->xmlChildrenNode; cur_node; cur_node = cur_node->next)
+            {
+                if (cur_node->type == XML_ELEMENT_NODE)
+                {
+                    if(xmlStrcmp(cur_node->name, (const xmlChar *)"first-name") == 0)
+                    {
+                        //info->first_name = xmlNodeListGetString(doc, cur_node->xmlChildrenNod, 1);
+                        info->first_name = xmlXPathCastNodeToString(cur_node); // Also xmlNodeGetContent(cur_node)
+                    }
+                    if(xmlStrcmp(cur_node->name, (const xmlChar *)"last-name") == 0)
+                    {
+                        info->last_name = xmlXPathCastNodeToString(cur_node); // Also xmlNodeGetContent(cur_node)
+                    }
+                    if(xmlStrcmp(cur_node->name, (const xmlChar *)"middle-name") == 0)
+                    {
+                        info->middle_name = xmlXPathCastNodeToString(cur_node); // Also xmlNodeGetContent(cur_node)
+                    }
+                }
+            }
+        }
+        xmlXPathFreeObject (result);
+    }
+
+    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:genre");
+    if (result) {
+        xmlChar *keyword = NULL;
+        nodeset = result->nodesetval;
+        for (int i=0; i < nodeset->nodeNr; i++) {
+            keyword = xmlNodeListGetString(doc, nodeset->nodeTab[i]->xmlChildrenNode, 1);
+#ifdef DEBUG
+            fprintf(stderr, "Genre: %s\n", keyword);
+#endif // DEBUG
+            if (keyword == NULL)
+                continue;
+            if (info->genres == NULL) {
+                info->genres = keyword;
+            } else {
+                info->genres = xmlStrcat(info->genres, BAD_CAST " ");
+                info->genres = xmlStrcat(info->genres, keyword);
+                xmlFree(keyword);
+            }
+        }
+        xmlXPathFreeObject (result);
+    }
+
+    result = getnodeset (doc, xpathCtx, (const xmlChar*)"/fb2:FictionBook/fb2:description/fb2:title-info/fb2:sequence");
+    if (result)
+    {
+        nodeset = result->nodesetval;
+        xmlNodePtr sequence_node = nodeset->nodeTab[0];
+        xmlChar *sequence_name = xmlGetProp(sequence_node, (const xmlChar *)"name");
+        xmlChar *sequence_number = xmlGetProp(sequence_node, (const xmlChar *)"number");
+#ifdef DEBUG
+//        fprintf(stderr, "Sequence: %s-%s\n", sequence_name, sequence_number);
+#endif // DEBUG
+        if(sequence_number)
+            xmlStrPrintf(info->sequence, LEN_SEQUENCE_STR, "%s - %s", sequence_name, sequence_number);
+        else
+            xmlStrPrintf(info->sequence, LEN_SEQUENCE_STR, "%s", sequence_name);
+
+        /* Kept apart for the search index */
+        info->sequence_name = sequence_name;
+        info->sequence_number = sequence_number;
+        xmlXPathFreeObject (result);
+    }
+    xmlXPathFreeContext(xpathCtx);
+    return FB2_RESULT_OK;
+}
+
+void
+clear_FB2Info(FB2Info *info)
+{
+    assert(info);
+    if(info->title != NULL) xmlFree(info->title);
+    if(info->first_name != NULL) xmlFree(info->first_name);
+    if(info->last_name != NULL) xmlFree(info->last_name);
+    if(info->middle_name != NULL) xmlFree(info->middle_name);
+    if(info->sequence_name != NULL) xmlFree(info->sequence_name);
+    if(info->sequence_number != NULL) xmlFree(info->sequence_number);
+    if(info->genres != NULL) xmlFree(info->genres);
+}
@@ -0,0 +1,66 @@
+#ifndef FB2_PARSE_H
+#define FB2_PARSE_H
+
+/* Reading FB2 metadata: content sniffing and a resumable parser.
+ *
+ * Used by the extension, which steps many parsers from idle callbacks, and
+ * by fb2-query --scan, which runs them to the end one after another. */
+
+#include <libxml/tree.h>
+#include <glib.h>
+
+#define LEN_SEQUENCE_STR 100
+typedef struct
+{
+    xmlChar *title;
+    xmlChar *first_name;
+    xmlChar *last_name;
+    xmlChar *middle_name;
+    xmlChar *sequence_name;
+    xmlChar *sequence_number;
+    xmlChar *genres; /* Space separated */
+    xmlChar sequence[LEN_SEQUENCE_STR];
+} FB2Info;
+
+enum FB2_RESULT {
+    FB2_RESULT_OK = 0,
+    FB2_RESULT_INVALID_FB2,
+    FB2_RESULT_CANT_OPEN,
+    FB2_RESULT_ZIP_OPEN_FILE_ERR,
+    FB2_RESULT_ZIP_READ_FILE_ERR,
+    FB2_RESULT_ZIP_CANT_CLOSE,
+    FB2_RESULT_UNABLE_PARSE_MEM_BUFF,
+    FB2_RESULT_UNABLE_CREATE_XPATH_CONTEXT,
+    FB2_RESULT_NOT_FB2,
+    FB2_RESULT_UNSUPPORTED,
+    FB2_RESULT_READ_ERR
+};
+
+/* Indexed by enum FB2_RESULT */
+extern const char *fb2_errors[];
+
+typedef struct _FB2Parser FB2Parser;
+
+/* Nothing is read before the first fb2_parser_step().
+   named: the file says it is a book by name or MIME type. A generic zip
+   is only one if it holds a single .fb2, otherwise it is a collection. */
+FB2Parser *fb2_parser_new(const char *filename, gboolean named);
+/* Sniffs and opens the file, or parses one chunk of it.
+   Returns TRUE once the result is known, the file is closed by then. */
+gboolean fb2_parser_step(FB2Parser *parser);
+/* Only meaningful after fb2_parser_step() returned TRUE */
+int fb2_parser_result(FB2Parser *parser);
+FB2Info *fb2_parser_info(FB2Parser *parser);
+/* Also drops a parser that is not done yet */
+void fb2_parser_free(FB2Parser *parser);
+
+/* For the columns and the negative cache, to be g_free'd */
+char *fb2_error_message(int result);
+/* Results that come out the same on every read of the same bytes */
+gboolean fb2_is_final_error(int result);
+/* .fb2, .fb2.zip or .fb2.gz */
+gboolean fb2_is_book_name(const char *name);
+
+void clear_FB2Info(FB2Info *info);
+
+#endif /* FB2_PARSE_H */
@@ -0,0 +1,309 @@
+/* Search the FB2 metadata index filled by the Nautilus extension.
+ *
+ * Usage: fb2-query [-i index] [-a author] [-t title] [-s sequence] [-g genre]
+ *                  [-f author|sequence|genre] [-l limit] [words...]
+ *        fb2-query [-i index] -p
+ *        fb2-query [-i index] --scan dir
+ *
+ * Words are prefix matched against title, author, sequence and genres;
+ * -a, -t and -s are case-insensitive prefixes, -g is an exact genre code.
+ * With -f the matching books are counted per author, sequence or genre
+ * instead of being listed.
+ * Books whose files are gone are not listed; -p removes them from the index,
+ * facet counts include them until then. It also prunes the negative cache.
+ * --scan (-S) adds the books under dir, so the index can be filled without
+ * opening every folder in Nautilus. Files that are indexed or rejected with
+ * the same size and mtime are not read again.
+ */
+#define _XOPEN_SOURCE 700 /* nftw, st_mtim */
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/parser.h>
+
+#include "fb2-index.h"
+#include "fb2-parse.h"
+
+/* Books per transaction, the extension's writer waits for each commit */
+#define SCAN_BATCH 100
+/* Open file descriptors for nftw */
+#define SCAN_MAX_FDS 32
+
+/* Books that don't say so by name, read like generic MIME types are */
+static const char *scan_container_suffixes[] = {".xml", ".zip", ".gz"};
+
+/* nftw has no user data */
+static struct {
+    FB2Index *index;
+    int batched;
+    int added;
+    int unchanged;
+    int rejected;
+    int failed;
+} scan;
+
+static gboolean
+scan_is_container(const char *name)
+{
+    for(int i = 0; i < G_N_ELEMENTS(scan_container_suffixes); ++i)
+        if(g_str_has_suffix(name, scan_container_suffixes[i]))
+            return TRUE;
+    return FALSE;
+}
+
+static int
+scan_put(const char *path, const struct stat *st, int64_t mtime, FB2Info *info)
+{
+    FB2IndexBook book;
+    memset(&book, 0, sizeof(FB2IndexBook));
+    book.path = path;
+    book.size = st->st_size;
+    book.mtime = mtime;
+    book.title = (const char*)info->title;
+    book.first_name = (const char*)info->first_name;
+    book.middle_name = (const char*)info->middle_name;
+    book.last_name = (const char*)info->last_name;
+    book.sequence_name = (const char*)info->sequence_name;
+    book.sequence_number = (const char*)info->sequence_number;
+    book.genres = (const char*)info->genres;
+    if(fb2_index_put(scan.index, &book) != 0)
+        return -1;
+    return fb2_index_unreject(scan.index, (int64_t)st->st_dev, (int64_t)st->st_ino);
+}
+
+/* Same bookkeeping as the extension's fb2_finish().
+   Returns 1, which stops nftw, when the index can't be written. */
+static int
+scan_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    if(type == FTW_DNR)
+        fprintf(stderr, "%s: can't read directory\n", path);
+    if(type != FTW_F)
+        return 0;
+    const char *name = path + ftw->base;
+    const gboolean named = fb2_is_book_name(name);
+    if(!named && !scan_is_container(name))
+        return 0;
+    const int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    int rc = fb2_index_is_current(scan.index, path, (int64_t)st->st_dev,
+                                  (int64_t)st->st_ino, st->st_size, mtime);
+    if(rc != 0) {
+        if(rc > 0)
+            ++scan.unchanged;
+        return rc < 0;
+    }
+
+    FB2Parser *parser = fb2_parser_new(path, named);
+    while(!fb2_parser_step(parser))
+        ;
+    const int result = fb2_parser_result(parser);
+    if(result == FB2_RESULT_OK) {
+        rc = scan_put(path, st, mtime, fb2_parser_info(parser));
+        ++scan.added;
+    } else {
+        char *reason = fb2_error_message(result);
+        if(fb2_is_final_error(result)) {
+            FB2IndexReject reject;
+            reject.device = (int64_t)st->st_dev;
+            reject.inode = (int64_t)st->st_ino;
+            reject.size = st->st_size;
+            reject.mtime = mtime;
+            reject.path = path;
+            reject.reason = reason;
+            if(fb2_index_remove(scan.index, path) != 0 ||
+               fb2_index_reject(scan.index, &reject) != 0)
+                rc = -1;
+            ++scan.rejected;
+        } else {
+            ++scan.failed;
+        }
+        /* Generic XML and archives are quietly skipped, like in Nautilus */
+        if(named || !fb2_is_final_error(result))
+            fprintf(stderr, "%s: %s\n", path, reason);
+        g_free(reason);
+    }
+    fb2_parser_free(parser);
+
+    if(rc == 0 && ++scan.batched >= SCAN_BATCH) {
+        rc = fb2_index_flush(scan.index);
+        scan.batched = 0;
+    }
+    return rc < 0;
+}
+
+/* Returns the number of books added, or -1 after reporting the error */
+static int
+scan_dir(FB2Index *index, const char *root)
+{
+    scan.index = index;
+    xmlInitParser();
+    /* Symbolic links are not followed, a link to a parent would never end */
+    const int rc = nftw(root, scan_file, SCAN_MAX_FDS, FTW_PHYS);
+    xmlCleanupParser();
+    if(rc < 0) {
+        perror(root);
+        return -1;
+    }
+    if(rc > 0 || fb2_index_flush(index) != 0) {
+        fprintf(stderr, "Scan failed: %s\n", fb2_index_error(index));
+        return -1;
+    }
+    return scan.added;
+}
+
+static void
+print_book(const FB2IndexBook *book, void *user_data)
+{
+    int *num_gone = user_data;
+    if(access(book->path, F_OK) != 0) {
+        ++*num_gone;
+        return;
+    }
+    printf("%s\t", book->author ? book->author : "");
+    if(book->sequence_name && book->sequence_number)
+        printf("%s - %s\t", book->sequence_name, book->sequence_number);
+    else
+        printf("%s\t", book->sequence_name ? book->sequence_name : "");
+    printf("%s\t%s\n", book->title ? book->title : "", book->path);
+}
+
+static void
+print_facet(const char *value, int count, void *user_data)
+{
+    printf("%d\t%s\n", count, value);
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-i index] [-a author] [-t title] [-s sequence] [-g genre]\n"
+            "          [-f author|sequence|genre] [-l limit] [words...]\n"
+            "       %s [-i index] -p\n"
+            "       %s [-i index] --scan dir\n",
+            argv0, argv0, argv0);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    FB2IndexQuery query;
+    char *path = NULL;
+    const char *facet = NULL;
+    char *words = NULL;
+    const char *scan_dir_arg = NULL;
+    char scan_root[PATH_MAX];
+    int prune = 0;
+    int num_gone = 0;
+    int opt;
+
+    memset(&query, 0, sizeof(FB2IndexQuery));
+    query.limit = 100;
+    static const struct option long_options[] = {
+        {"scan", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    while((opt = getopt_long(argc, argv, "i:a:t:s:g:f:l:pS:", long_options, NULL)) != -1) {
+        switch(opt) {
+        case 'i': path = strdup(optarg); break;
+        case 'a': query.author = optarg; break;
+        case 't': query.title = optarg; break;
+        case 's': query.sequence = optarg; break;
+        case 'g': query.genre = optarg; break;
+        case 'f': facet = optarg; break;
+        case 'l': query.limit = atoi(optarg); break;
+        case 'p': prune = 1; break;
+        case 'S': scan_dir_arg = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind < argc) {
+        size_t len = 1;
+        for(int i = optind; i < argc; ++i)
+            len += strlen(argv[i]) + 1;
+        words = calloc(1, len);
+        for(int i = optind; i < argc; ++i) {
+            strcat(words, argv[i]);
+            strcat(words, " ");
+        }
+        query.words = words;
+    }
+    if(path == NULL)
+        path = fb2_index_default_path();
+    if(path == NULL)
+        usage(argv[0]);
+    /* The extension indexes absolute paths */
+    if(scan_dir_arg != NULL && realpath(scan_dir_arg, scan_root) == NULL) {
+        perror(scan_dir_arg);
+        return EXIT_FAILURE;
+    }
+    if(scan_dir_arg == NULL && access(path, F_OK) != 0) {
+        fprintf(stderr, "No index at %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    /* Never let a query change the schema under a running Nautilus */
+    int version;
+    const int writable = prune || scan_dir_arg != NULL;
+    FB2Index *index = fb2_index_open(path, writable ? FB2_INDEX_READ_WRITE : FB2_INDEX_READ_ONLY,
+                                     &version);
+    if(index == NULL) {
+        if(version >= 0 && version != FB2_INDEX_VERSION)
+            fprintf(stderr, "Index %s has schema version %d, this fb2-query reads version %d;\n"
+                            "use the fb2-query built with the installed extension\n",
+                    path, version, FB2_INDEX_VERSION);
+        else
+            fprintf(stderr, "Can't open index %s\n", path);
+        return EXIT_FAILURE;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count;
+    if(scan_dir_arg != NULL)
+        count = scan_dir(index, scan_root);
+    else if(prune) {
+        count = fb2_index_prune(index);
+        if(count >= 0 && fb2_index_prune_rejects(index) < 0)
+            count = -1;
+    }
+    else if(facet == NULL)
+        count = fb2_index_search(index, &query, print_book, &num_gone);
+    else if(strcmp(facet, "author") == 0)
+        count = fb2_index_facets(index, &query, FB2_INDEX_FACET_AUTHOR, print_facet, NULL);
+    else if(strcmp(facet, "sequence") == 0)
+        count = fb2_index_facets(index, &query, FB2_INDEX_FACET_SEQUENCE, print_facet, NULL);
+    else if(strcmp(facet, "genre") == 0)
+        count = fb2_index_facets(index, &query, FB2_INDEX_FACET_GENRE, print_facet, NULL);
+    else
+        usage(argv[0]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if(scan_dir_arg != NULL) {
+        /* Errors are reported by scan_dir() */
+        if(count >= 0)
+            fprintf(stderr, "%d books added, %d unchanged, %d rejected, %d unreadable, %.3f ms\n",
+                    count, scan.unchanged, scan.rejected, scan.failed, ms);
+    }
+    else if(count < 0)
+        fprintf(stderr, "Query failed: %s\n", fb2_index_error(index));
+    else if(prune)
+        fprintf(stderr, "%d books removed, %.3f ms\n", count, ms);
+    else if(num_gone > 0)
+        fprintf(stderr, "%d rows, %d more with missing files (see -p), %.3f ms\n",
+                count - num_gone, num_gone, ms);
+    else
+        fprintf(stderr, "%d rows, %.3f ms\n", count, ms);
+
+    fb2_index_close(index);
+    free(words);
+    free(path);
+    return count < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}